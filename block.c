@@ -11,19 +11,296 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
+// linux/fs.h, pulled in by io_uring.h, has its own BLOCK_SIZE
+#undef BLOCK_SIZE
 #include "block.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+// Longest run of dirty blocks bio_flush() writes with one pwritev()
+#define FLUSH_MAX_IOV 256
 
 int diskfile = -1;
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+/*
+ * Block cache
+ *
+ * bio_read() and bio_write() go through a fixed number of BLOCK_SIZE
+ * buffers. Blocks are found through a hash on the block number and
+ * replaced in LRU order. Writes only dirty the buffer; the disk file is
+ * updated when a dirty block is evicted or when bio_flush() is called.
+ */
+struct bcache_entry {
+	int block_num;						/* cached block, -1 if unused */
+	int dirty;							/* buffer is newer than the disk */
+	int pins;							/* bio_get() references held */
+	int held;							/* dirtied in the open journal transaction, see bio_hold() */
+	char *data;							/* BLOCK_SIZE bytes */
+	struct bcache_entry *hnext;			/* hash chain */
+	struct bcache_entry *prev, *next;	/* LRU list, head is most recent */
+};
+
+static struct bcache_entry *bcache;
+static struct bcache_entry **bcache_hash;
+static struct bcache_entry *lru_head, *lru_tail;
+static char *bcache_mem;
+static int bcache_size;
+static int bcache_buckets;
+static int disk_blocks;
+static unsigned long bcache_hits;
+static unsigned long bcache_misses;
+static int bcache_hold;					/* new dirty blocks are held */
+static int bcache_nheld;
+
+/*
+ * io_uring backend
+ *
+ * After bio_uring_init() the disk file is accessed through an io_uring
+ * instead of pread/pwrite. The disk file is registered with the ring, and
+ * the cache buffers are registered as one fixed buffer so cache misses and
+ * write-backs use READ_FIXED/WRITE_FIXED. Requests are queued with
+ * uring_prep() and uring_wait() submits everything queued and waits for
+ * it, so bio_flush() and bio_readv() hand all of their blocks to the
+ * kernel in one io_uring_enter() and let them proceed concurrently.
+ */
+#define URING_ENTRIES 128
+
+struct uring_req {
+	int opcode;
+	char *buf;
+	unsigned len;
+};
+
+static struct {
+	int fd;								/* ring, -1 when not in use */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+	unsigned queued;					/* prepared, not submitted yet */
+	unsigned inflight;					/* submitted, not completed yet */
+	int failed;							/* a request since the last wait failed */
+	int fixed_bufs;						/* the cache memory is registered */
+	struct uring_req reqs[URING_ENTRIES];
+} uring = { .fd = -1 };
+
+static int uring_enter(unsigned to_submit, unsigned min_complete) {
+	return syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+//Submit everything queued and wait until all of it has completed
+static int uring_wait() {
+	while (uring.queued > 0 || uring.inflight > 0) {
+		int ret = uring_enter(uring.queued, uring.queued + uring.inflight);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("io_uring_enter failed");
+			return -1;
+		}
+		uring.queued -= ret;
+		uring.inflight += ret;
+
+		unsigned head = *uring.cq_head;
+		while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+			struct uring_req *req = &uring.reqs[cqe->user_data];
+			if (cqe->res < 0) {
+				fprintf(stderr, "block io failed: %s\n", strerror(-cqe->res));
+				uring.failed = 1;
+			} else if ((unsigned)cqe->res < req->len) {
+				// Reads past the end of the disk file come back as zeroes
+				if (req->opcode == IORING_OP_READ || req->opcode == IORING_OP_READ_FIXED)
+					memset(req->buf + cqe->res, 0, req->len - cqe->res);
+				else
+					uring.failed = 1;
+			}
+			head++;
+			uring.inflight--;
+		}
+		__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	int failed = uring.failed;
+	uring.failed = 0;
+	return failed ? -1 : 0;
+}
+
+//Queue one request for len bytes at block_num, buffers in the cache go as fixed buffers
+static int uring_prep(int opcode, int block_num, void *buf, unsigned len) {
+	if (uring.queued + uring.inflight == URING_ENTRIES && uring_wait() < 0)
+		uring.failed = 1;
+
+	int in_cache = uring.fixed_bufs && (char *)buf >= bcache_mem &&
+				   (char *)buf < bcache_mem + (size_t)bcache_size * BLOCK_SIZE;
+	if (in_cache)
+		opcode = (opcode == IORING_OP_READ) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+
+	unsigned slot = uring.queued + uring.inflight;
+	unsigned tail = *uring.sq_tail;
+	unsigned idx = tail & *uring.sq_mask;
+	struct io_uring_sqe *sqe = &uring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0;
+	sqe->off = (off_t)block_num * BLOCK_SIZE;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->buf_index = 0;
+	sqe->user_data = slot;
+	uring.reqs[slot].opcode = opcode;
+	uring.reqs[slot].buf = buf;
+	uring.reqs[slot].len = len;
+	uring.sq_array[idx] = idx;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring.queued++;
+	return 0;
+}
+
+//Register the cache buffers with the ring, if there are both
+static void uring_register_bufs() {
+	struct iovec iov = { bcache_mem, (size_t)bcache_size * BLOCK_SIZE };
+
+	uring.fixed_bufs = 0;
+	if (uring.fd < 0 || bcache_size == 0)
+		return;
+	if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0)
+		uring.fixed_bufs = 1;
+}
+
+static void uring_unregister_bufs() {
+	if (uring.fixed_bufs)
+		syscall(__NR_io_uring_register, uring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	uring.fixed_bufs = 0;
+}
+
+static void uring_free() {
+	if (uring.fd < 0)
+		return;
+	uring_unregister_bufs();
+	munmap(uring.sqes, uring.sqes_len);
+	if (uring.cq_ring != uring.sq_ring)
+		munmap(uring.cq_ring, uring.cq_ring_len);
+	munmap(uring.sq_ring, uring.sq_ring_len);
+	close(uring.fd);
+	uring.fd = -1;
+}
+
+//Switch disk I/O to an io_uring, returns -1 if the kernel does not allow it
+int bio_uring_init() {
+	struct io_uring_params p;
+
+	if (uring.fd >= 0)
+		return 0;
+	if (diskfile < 0)
+		return -1;
+	memset(&p, 0, sizeof(p));
+	uring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (uring.fd < 0) {
+		perror("io_uring_setup failed");
+		return -1;
+	}
+
+	uring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring.cq_ring_len > uring.sq_ring_len)
+			uring.sq_ring_len = uring.cq_ring_len;
+		uring.cq_ring_len = uring.sq_ring_len;
+	}
+	uring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring.sq_ring = mmap(NULL, uring.sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+	uring.cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP) ? uring.sq_ring :
+		mmap(NULL, uring.cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+	uring.sqes = mmap(NULL, uring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+	if (uring.sq_ring == MAP_FAILED || uring.cq_ring == MAP_FAILED || uring.sqes == MAP_FAILED) {
+		perror("io_uring mmap failed");
+		close(uring.fd);
+		uring.fd = -1;
+		return -1;
+	}
+
+	char *sq = uring.sq_ring, *cq = uring.cq_ring;
+	uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+	uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+	uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	uring.queued = uring.inflight = 0;
+	uring.failed = 0;
+
+	if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES, &diskfile, 1) < 0) {
+		perror("io_uring_register failed");
+		uring_free();
+		return -1;
+	}
+	uring_register_bufs();
+	return 0;
+}
+
+/*
+ * Memory mapped mode
+ *
+ * After bio_mmap_init() the whole disk file is mapped shared. Block reads
+ * and writes become copies to and from the mapping, bio_get() hands out
+ * pointers straight into it and the page cache takes the place of the
+ * block cache. bio_sync() and dev_close() msync() the mapping.
+ */
+static char *disk_map;
+static size_t disk_map_len;
+
+#define MAPPED(block_num, n) (disk_map != NULL && (block_num) >= 0 && \
+							  (size_t)((block_num) + (n)) * BLOCK_SIZE <= disk_map_len)
+
+//Map the disk file, returns -1 if it cannot be mapped
+int bio_mmap_init() {
+	struct stat st;
+	void *map;
+
+	if (disk_map != NULL)
+		return 0;
+	if (diskfile < 0 || fstat(diskfile, &st) < 0 || st.st_size == 0)
+		return -1;
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap failed");
+		return -1;
+	}
+
+	// Blocks still in the cache go to the file first, then the cache is dropped
+	bio_flush();
+	bio_cache_free();
+	disk_map = map;
+	disk_map_len = st.st_size;
+	return 0;
+}
+
+static void mmap_free() {
+	if (disk_map == NULL)
+		return;
+	if (msync(disk_map, disk_map_len, MS_SYNC) < 0)
+		perror("msync failed");
+	munmap(disk_map, disk_map_len);
+	disk_map = NULL;
+	disk_map_len = 0;
+}
+
+//Creates a file of size bytes which is your new emulated disk
+void dev_init(const char* diskfile_path, off_t size) {
     if (diskfile >= 0) {
 		return;
     }
@@ -34,7 +311,8 @@ void dev_init(const char* diskfile_path) {
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    if (ftruncate(diskfile, size) < 0)
+		perror("ftruncate failed");
 }
 
 //Function to open the disk file
@@ -53,14 +331,23 @@ int dev_open(const char* diskfile_path) {
 
 void dev_close() {
     if (diskfile >= 0) {
+		bio_flush();
+		bio_cache_free();
+		mmap_free();
+		uring_free();
 		close(diskfile);
+		diskfile = -1;
     }
 }
 
-//Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+//Read a block straight from the disk file
+static int disk_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (uring.fd >= 0) {
+		uring_prep(IORING_OP_READ, block_num, buf, BLOCK_SIZE);
+		return uring_wait() < 0 ? -1 : BLOCK_SIZE;
+    }
+    retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
@@ -70,13 +357,707 @@ int bio_read(const int block_num, void *buf) {
     return retstat;
 }
 
-//Write a block to the disk
-int bio_write(const int block_num, const void *buf) {
+//Write a block straight to the disk file
+static int disk_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (uring.fd >= 0) {
+		uring_prep(IORING_OP_WRITE, block_num, (void *)buf, BLOCK_SIZE);
+		return uring_wait() < 0 ? -1 : BLOCK_SIZE;
+    }
+    retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		    perror("block_write failed");
+    }
+    return retstat;
+}
+
+//Read nblocks consecutive blocks straight from the disk file in one call
+static int disk_readv(const int block_num, int nblocks, void *buf) {
+    size_t len = (size_t)nblocks*BLOCK_SIZE;
+    if (uring.fd >= 0) {
+		uring_prep(IORING_OP_READ, block_num, buf, len);
+		return uring_wait() < 0 ? -1 : (int)len;
+    }
+    ssize_t retstat = pread(diskfile, buf, len, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		memset(buf, 0, len);
+		printf("block_read failed %d", block_num);
+		return -1;
+    }
+    if ((size_t)retstat < len)
+		memset((char *)buf + retstat, 0, len - retstat);
+    return len;
+}
+
+//Write consecutive blocks from iovcnt block buffers in one call
+static int disk_writev(const int block_num, const struct iovec *iov, int iovcnt) {
+    if (uring.fd >= 0) {
+		for (int i = 0, off = 0; i < iovcnt; off += iov[i].iov_len / BLOCK_SIZE, i++)
+			uring_prep(IORING_OP_WRITE, block_num + off, iov[i].iov_base, iov[i].iov_len);
+		return uring_wait();
+    }
+    ssize_t retstat = pwritev(diskfile, iov, iovcnt, (off_t)block_num*BLOCK_SIZE);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+//Allocate a cache of nr_blocks buffers, 0 disables caching
+int bio_cache_init(int nr_blocks) {
+	struct stat st;
+
+	bio_cache_free();
+	disk_blocks = 0;
+	if (diskfile >= 0 && fstat(diskfile, &st) == 0)
+		disk_blocks = st.st_size / BLOCK_SIZE;
+	if (nr_blocks <= 0 || disk_map != NULL)
+		return 0;
+
+	bcache_buckets = 1;
+	while (bcache_buckets < nr_blocks)
+		bcache_buckets <<= 1;
+	bcache = calloc(nr_blocks, sizeof(struct bcache_entry));
+	bcache_hash = calloc(bcache_buckets, sizeof(struct bcache_entry *));
+	bcache_mem = malloc((size_t)nr_blocks * BLOCK_SIZE);
+	if (bcache == NULL || bcache_hash == NULL || bcache_mem == NULL) {
+		perror("bio_cache_init failed");
+		bio_cache_free();
+		return -1;
+	}
+
+	// All buffers start unused on the LRU list
+	for (int i = 0; i < nr_blocks; i++) {
+		bcache[i].block_num = -1;
+		bcache[i].data = bcache_mem + (size_t)i * BLOCK_SIZE;
+		bcache[i].prev = (i > 0) ? &bcache[i - 1] : NULL;
+		bcache[i].next = (i < nr_blocks - 1) ? &bcache[i + 1] : NULL;
+	}
+	lru_head = &bcache[0];
+	lru_tail = &bcache[nr_blocks - 1];
+	bcache_size = nr_blocks;
+	bcache_hits = 0;
+	bcache_misses = 0;
+	uring_register_bufs();
+	return 0;
+}
+
+//Release the cache, dirty blocks must have been flushed already
+void bio_cache_free() {
+	uring_unregister_bufs();
+	free(bcache);
+	free(bcache_hash);
+	free(bcache_mem);
+	bcache = NULL;
+	bcache_hash = NULL;
+	bcache_mem = NULL;
+	lru_head = lru_tail = NULL;
+	bcache_size = 0;
+	bcache_hold = 0;
+	bcache_nheld = 0;
+}
+
+void bio_cache_stats(unsigned long *hits, unsigned long *misses) {
+	*hits = bcache_hits;
+	*misses = bcache_misses;
+}
+
+static struct bcache_entry *bcache_lookup(int block_num) {
+	struct bcache_entry *e = bcache_hash[block_num & (bcache_buckets - 1)];
+	while (e != NULL && e->block_num != block_num)
+		e = e->hnext;
+	return e;
+}
+
+static void bcache_unhash(struct bcache_entry *e) {
+	struct bcache_entry **pp = &bcache_hash[e->block_num & (bcache_buckets - 1)];
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+	e->hnext = NULL;
+	e->block_num = -1;
+}
+
+//Move an entry to the most recently used end of the list
+static void bcache_touch(struct bcache_entry *e) {
+	if (lru_head == e)
+		return;
+	e->prev->next = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		lru_tail = e->prev;
+	e->prev = NULL;
+	e->next = lru_head;
+	lru_head->prev = e;
+	lru_head = e;
+}
+
+//Take the least recently used unpinned buffer for block_num, writing it back if dirty
+static struct bcache_entry *bcache_victim(int block_num) {
+	struct bcache_entry *e = lru_tail;
+
+	while (e != NULL && (e->pins > 0 || e->held))
+		e = e->prev;
+	if (e == NULL)
+		return NULL;
+	if (e->block_num >= 0) {
+		if (e->dirty && disk_write(e->block_num, e->data) < 0)
+			return NULL;
+		bcache_unhash(e);
+	}
+	e->dirty = 0;
+	e->block_num = block_num;
+	e->hnext = bcache_hash[block_num & (bcache_buckets - 1)];
+	bcache_hash[block_num & (bcache_buckets - 1)] = e;
+	bcache_touch(e);
+	return e;
+}
+
+/*
+ * Locking. bio_mutex protects the cache and the io_uring. The public
+ * entry points below take it around cache_*() helpers, which expect it to
+ * be held. Without a cache and a ring, and for blocks inside the mapping,
+ * pread/pwrite/memcpy need no lock. bio_cache_init(), bio_uring_init() and
+ * bio_mmap_init() run before any other thread uses the disk.
+ */
+static pthread_mutex_t bio_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define BIO_UNLOCKED() (bcache_size == 0 && uring.fd < 0)
+
+static int cache_read(const int block_num, void *buf) {
+	struct bcache_entry *e;
+
+	if (bcache_size == 0 || block_num < 0 || block_num >= disk_blocks)
+		return disk_read(block_num, buf);
+
+	e = bcache_lookup(block_num);
+	if (e != NULL) {
+		bcache_hits++;
+	} else {
+		bcache_misses++;
+		e = bcache_victim(block_num);
+		if (e == NULL)
+			return disk_read(block_num, buf);
+		if (disk_read(block_num, e->data) < 0) {
+			bcache_unhash(e);
+			memset(buf, 0, BLOCK_SIZE);
+			return -1;
+		}
+	}
+	bcache_touch(e);
+	memcpy(buf, e->data, BLOCK_SIZE);
+	return BLOCK_SIZE;
+}
+
+//Mark a cached block dirty, held in the journal transaction or not
+static void bcache_dirty(struct bcache_entry *e, int held) {
+	e->dirty = 1;
+	if (held != e->held) {
+		e->held = held;
+		bcache_nheld += held ? 1 : -1;
+	}
+}
+
+static int cache_write(const int block_num, const void *buf, int held) {
+	struct bcache_entry *e;
+
+	if (bcache_size == 0 || block_num < 0 || block_num >= disk_blocks)
+		return disk_write(block_num, buf);
+
+	// A whole block is overwritten, so a miss needs no read from disk
+	e = bcache_lookup(block_num);
+	if (e == NULL)
+		e = bcache_victim(block_num);
+	if (e == NULL)
+		return disk_write(block_num, buf);
+	bcache_touch(e);
+	memcpy(e->data, buf, BLOCK_SIZE);
+	bcache_dirty(e, held);
+	return BLOCK_SIZE;
+}
+
+//Read a block from the disk
+int bio_read(const int block_num, void *buf) {
+	int ret;
+
+	if (MAPPED(block_num, 1)) {
+		memcpy(buf, disk_map + (size_t)block_num * BLOCK_SIZE, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+	if (BIO_UNLOCKED())
+		return disk_read(block_num, buf);
+
+	pthread_mutex_lock(&bio_mutex);
+	ret = cache_read(block_num, buf);
+	pthread_mutex_unlock(&bio_mutex);
+	return ret;
+}
+
+//Write a block to the disk
+int bio_write(const int block_num, const void *buf) {
+	int ret;
+
+	if (MAPPED(block_num, 1)) {
+		memcpy(disk_map + (size_t)block_num * BLOCK_SIZE, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+	if (BIO_UNLOCKED())
+		return disk_write(block_num, buf);
+
+	pthread_mutex_lock(&bio_mutex);
+	ret = cache_write(block_num, buf, bcache_hold);
+	pthread_mutex_unlock(&bio_mutex);
+	return ret;
+}
+
+/*
+ * Write a block of file data. Same as bio_write(), but the block is never
+ * held for the journal: file data goes to its place on disk before the
+ * metadata that points to it is committed.
+ */
+int bio_write_data(const int block_num, const void *buf) {
+	int ret;
+
+	if (MAPPED(block_num, 1)) {
+		memcpy(disk_map + (size_t)block_num * BLOCK_SIZE, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+	if (BIO_UNLOCKED())
+		return disk_write(block_num, buf);
+
+	pthread_mutex_lock(&bio_mutex);
+	ret = cache_write(block_num, buf, 0);
+	pthread_mutex_unlock(&bio_mutex);
+	return ret;
+}
+
+static void *cache_get(const int block_num) {
+	struct bcache_entry *e = NULL;
+	char *data;
+
+	if (bcache_size > 0 && block_num >= 0 && block_num < disk_blocks) {
+		e = bcache_lookup(block_num);
+		if (e != NULL) {
+			bcache_hits++;
+		} else {
+			bcache_misses++;
+			e = bcache_victim(block_num);
+			if (e != NULL && disk_read(block_num, e->data) < 0) {
+				bcache_unhash(e);
+				return NULL;
+			}
+		}
+	}
+	if (e != NULL) {
+		bcache_touch(e);
+		e->pins++;
+		return e->data;
+	}
+
+	data = malloc(BLOCK_SIZE);
+	if (data != NULL && disk_read(block_num, data) < 0) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static void cache_put(const int block_num, void *data, int dirty) {
+	char *p = data;
+
+	if (bcache_size > 0 && p >= bcache_mem && p < bcache_mem + (size_t)bcache_size * BLOCK_SIZE) {
+		struct bcache_entry *e = &bcache[(p - bcache_mem) / BLOCK_SIZE];
+		if (e->pins > 0)
+			e->pins--;
+		if (dirty)
+			bcache_dirty(e, bcache_hold);
+		return;
+	}
+	if (dirty)
+		disk_write(block_num, data);
+	free(data);
+}
+
+/*
+ * Zero-copy block access. bio_get() returns a pointer to the data of
+ * block_num that stays valid until the matching bio_put(), which must be
+ * told whether the block was changed through the pointer. In mmap mode
+ * the pointer is into the mapping, otherwise it is a cache buffer that is
+ * pinned against eviction, or a private copy if nothing can be cached.
+ * Threads sharing a block through bio_get() must serialize among
+ * themselves, the cache only keeps the buffer in place.
+ */
+void *bio_get(const int block_num) {
+	void *data;
+
+	if (MAPPED(block_num, 1))
+		return disk_map + (size_t)block_num * BLOCK_SIZE;
+
+	pthread_mutex_lock(&bio_mutex);
+	data = cache_get(block_num);
+	pthread_mutex_unlock(&bio_mutex);
+	return data;
+}
+
+void bio_put(const int block_num, void *data, int dirty) {
+	if (data == NULL || MAPPED(block_num, 1))
+		return;
+
+	pthread_mutex_lock(&bio_mutex);
+	cache_put(block_num, data, dirty);
+	pthread_mutex_unlock(&bio_mutex);
+}
+
+/*
+ * Read nblocks consecutive blocks starting at block_num into buf. Cached
+ * blocks are copied from the cache, every run of uncached blocks is read
+ * with one call straight into buf without going through the cache, so
+ * large sequential reads neither pay per-block calls nor evict the
+ * metadata the cache holds. Without io_uring bio_mutex is dropped while
+ * those runs are read, so other threads keep using the cache.
+ */
+static int cache_readv(const int block_num, int nblocks, void *buf) {
+	char *dst = buf;
+	int start = 0;
+
+	if (bcache_size == 0 || block_num < 0 || block_num + nblocks > disk_blocks)
+		return disk_readv(block_num, nblocks, buf);
+
+	for (int i = 0; i <= nblocks; i++) {
+		struct bcache_entry *e = (i < nblocks) ? bcache_lookup(block_num + i) : NULL;
+		if (i < nblocks && e == NULL)
+			continue;
+		if (i > start) {
+			bcache_misses += i - start;
+			if (uring.fd >= 0) {
+				uring_prep(IORING_OP_READ, block_num + start, dst + (size_t)start * BLOCK_SIZE, (i - start) * BLOCK_SIZE);
+			} else {
+				pthread_mutex_unlock(&bio_mutex);
+				int ret = disk_readv(block_num + start, i - start, dst + (size_t)start * BLOCK_SIZE);
+				pthread_mutex_lock(&bio_mutex);
+				if (ret < 0)
+					return -1;
+				// The block that ended the run may have been evicted meanwhile
+				if (e != NULL)
+					e = bcache_lookup(block_num + i);
+				if (e == NULL && i < nblocks && cache_read(block_num + i, dst + (size_t)i * BLOCK_SIZE) < 0)
+					return -1;
+			}
+		}
+		if (e != NULL) {
+			bcache_hits++;
+			bcache_touch(e);
+			memcpy(dst + (size_t)i * BLOCK_SIZE, e->data, BLOCK_SIZE);
+		}
+		start = i + 1;
+	}
+
+	// With io_uring the uncached runs were only queued so far
+	if (uring.fd >= 0 && uring_wait() < 0)
+		return -1;
+	return nblocks * BLOCK_SIZE;
+}
+
+int bio_readv(const int block_num, int nblocks, void *buf) {
+	int ret;
+
+	if (MAPPED(block_num, nblocks)) {
+		memcpy(buf, disk_map + (size_t)block_num * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+		return nblocks * BLOCK_SIZE;
+	}
+	if (BIO_UNLOCKED())
+		return disk_readv(block_num, nblocks, buf);
+
+	pthread_mutex_lock(&bio_mutex);
+	ret = cache_readv(block_num, nblocks, buf);
+	pthread_mutex_unlock(&bio_mutex);
+	return ret;
+}
+
+/*
+ * Tell the kernel that nblocks blocks from block_num will be read soon. It
+ * starts reading them into the page cache in the background and returns
+ * at once, so the pread(), io_uring read or page fault that wants them
+ * later finds them in memory. The block cache is left alone.
+ */
+void bio_readahead(const int block_num, int nblocks) {
+	if (block_num < 0 || nblocks <= 0)
+		return;
+	if (MAPPED(block_num, nblocks)) {
+		madvise(disk_map + (size_t)block_num * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE, MADV_WILLNEED);
+		return;
+	}
+	if (diskfile >= 0)
+		posix_fadvise(diskfile, (off_t)block_num * BLOCK_SIZE, (off_t)nblocks * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Write nblocks consecutive blocks starting at block_num from buf with one
+ * call. The write goes straight to the disk file; copies of these blocks in
+ * the cache are updated and become clean. They are updated before the
+ * write so that a concurrent flush cannot put older data over it; without
+ * io_uring the write itself runs without bio_mutex.
+ */
+int bio_writev(const int block_num, int nblocks, const void *buf) {
+	struct iovec iov = { (void *)buf, (size_t)nblocks * BLOCK_SIZE };
+	const char *src = buf;
+	int ret;
+
+	if (MAPPED(block_num, nblocks)) {
+		memcpy(disk_map + (size_t)block_num * BLOCK_SIZE, buf, (size_t)nblocks * BLOCK_SIZE);
+		return nblocks * BLOCK_SIZE;
+	}
+	if (BIO_UNLOCKED())
+		return disk_writev(block_num, &iov, 1) < 0 ? -1 : nblocks * BLOCK_SIZE;
+
+	pthread_mutex_lock(&bio_mutex);
+	for (int i = 0; i < nblocks && block_num >= 0 && block_num + i < disk_blocks && bcache_size > 0; i++) {
+		struct bcache_entry *e = bcache_lookup(block_num + i);
+		if (e != NULL) {
+			memcpy(e->data, src + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+			e->dirty = 0;
+			if (e->held) {
+				e->held = 0;
+				bcache_nheld--;
+			}
+		}
+	}
+	if (uring.fd >= 0) {
+		ret = disk_writev(block_num, &iov, 1);
+		pthread_mutex_unlock(&bio_mutex);
+	} else {
+		pthread_mutex_unlock(&bio_mutex);
+		ret = disk_writev(block_num, &iov, 1);
+	}
+	return ret < 0 ? -1 : nblocks * BLOCK_SIZE;
+}
+
+static int bcache_cmp(const void *a, const void *b) {
+	const struct bcache_entry *x = *(struct bcache_entry * const *)a;
+	const struct bcache_entry *y = *(struct bcache_entry * const *)b;
+	return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+}
+
+//Whether block_num is in one of the sorted, disjoint runs
+static int in_runs(const struct bio_run *runs, int nruns, int block_num) {
+	int lo = 0, hi = nruns - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (block_num < runs[mid].start)
+			hi = mid - 1;
+		else if (block_num >= runs[mid].start + runs[mid].len)
+			lo = mid + 1;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+//Write every dirty block that is not held back to the disk file in block order, only those in runs unless runs is NULL
+static int cache_flush(const struct bio_run *runs, int nruns) {
+	struct bcache_entry **dirty;
+	int ndirty = 0;
+	int ret = 0;
+
+	if (bcache_size == 0)
+		return 0;
+	dirty = malloc(bcache_size * sizeof(struct bcache_entry *));
+	if (dirty == NULL)
+		return -1;
+	for (int i = 0; i < bcache_size; i++) {
+		if (bcache[i].block_num >= 0 && bcache[i].dirty && !bcache[i].held &&
+			(runs == NULL || in_runs(runs, nruns, bcache[i].block_num)))
+			dirty[ndirty++] = &bcache[i];
+	}
+	qsort(dirty, ndirty, sizeof(struct bcache_entry *), bcache_cmp);
+
+	// With io_uring every dirty block is queued and a single wait covers them
+	if (uring.fd >= 0) {
+		for (int i = 0; i < ndirty; i++)
+			uring_prep(IORING_OP_WRITE, dirty[i]->block_num, dirty[i]->data, BLOCK_SIZE);
+		if (uring_wait() < 0) {
+			ret = -1;
+		} else {
+			for (int i = 0; i < ndirty; i++)
+				dirty[i]->dirty = 0;
+		}
+		free(dirty);
+		return ret;
+	}
+
+	// Runs of consecutive dirty blocks go out with a single pwritev()
+	struct iovec iov[FLUSH_MAX_IOV];
+	for (int i = 0; i < ndirty; ) {
+		int n = 0;
+		do {
+			iov[n].iov_base = dirty[i + n]->data;
+			iov[n].iov_len = BLOCK_SIZE;
+			n++;
+		} while (i + n < ndirty && n < FLUSH_MAX_IOV &&
+				 dirty[i + n]->block_num == dirty[i]->block_num + n);
+		if (disk_writev(dirty[i]->block_num, iov, n) < 0) {
+			ret = -1;
+		} else {
+			for (int k = 0; k < n; k++)
+				dirty[i + k]->dirty = 0;
+		}
+		i += n;
+	}
+	free(dirty);
+	return ret;
+}
+
+int bio_flush() {
+	int ret;
+
+	pthread_mutex_lock(&bio_mutex);
+	ret = cache_flush(NULL, 0);
+	pthread_mutex_unlock(&bio_mutex);
+	return ret;
+}
+
+//Make what has been written to the disk file durable, the cache is left as it is
+int bio_barrier() {
+	if (disk_map != NULL) {
+		if (msync(disk_map, disk_map_len, MS_SYNC) < 0) {
+			perror("bio_barrier failed");
+			return -1;
+		}
+	} else if (diskfile >= 0 && fdatasync(diskfile) < 0) {
+		perror("bio_barrier failed");
+		return -1;
+	}
+	return 0;
+}
+
+//Flush the cache and make the disk file durable
+int bio_sync() {
+	int ret = bio_flush();
+	if (bio_barrier() < 0)
+		ret = -1;
+	return ret;
+}
+
+static int run_cmp(const void *a, const void *b) {
+	const struct bio_run *x = a, *y = b;
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+//Sort runs and merge the ones that overlap or touch, returns how many are left
+static int runs_merge(struct bio_run *runs, int nruns) {
+	int n = 0;
+
+	qsort(runs, nruns, sizeof(struct bio_run), run_cmp);
+	for (int i = 0; i < nruns; i++) {
+		if (n > 0 && runs[i].start <= runs[n - 1].start + runs[n - 1].len) {
+			int end = runs[i].start + runs[i].len;
+			if (end > runs[n - 1].start + runs[n - 1].len)
+				runs[n - 1].len = end - runs[n - 1].start;
+		} else {
+			runs[n++] = runs[i];
+		}
+	}
+	return n;
+}
+
+/*
+ * bio_flush() for part of the disk: write back the dirty blocks in runs
+ * that are not held, leaving the rest of the cache dirty. runs is sorted
+ * and merged in place. Nothing is made durable.
+ */
+int bio_flush_runs(struct bio_run *runs, int nruns) {
+	int ret;
+	int n = runs_merge(runs, nruns);
+
+	pthread_mutex_lock(&bio_mutex);
+	ret = cache_flush(runs, n);
+	pthread_mutex_unlock(&bio_mutex);
+	return ret;
+}
+
+/*
+ * bio_sync() for part of the disk: write back the dirty blocks in runs,
+ * leaving the rest of the cache dirty, then make the disk file durable.
+ * runs is sorted and merged in place.
+ */
+int bio_sync_runs(struct bio_run *runs, int nruns) {
+	int ret = 0;
+	int n = runs_merge(runs, nruns);
+
+	// A mapping is synced one range at a time, msync() waits for each
+	if (disk_map != NULL) {
+		for (int i = 0; i < n; i++) {
+			if (!MAPPED(runs[i].start, runs[i].len))
+				continue;
+			if (msync(disk_map + (size_t)runs[i].start * BLOCK_SIZE, (size_t)runs[i].len * BLOCK_SIZE, MS_SYNC) < 0) {
+				perror("bio_sync_runs failed");
+				ret = -1;
+			}
+		}
+		return ret;
+	}
+
+	pthread_mutex_lock(&bio_mutex);
+	ret = cache_flush(runs, n);
+	pthread_mutex_unlock(&bio_mutex);
+	if (bio_barrier() < 0)
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Journal support. While holding is on, blocks dirtied with bio_write()
+ * or bio_put() are held: they stay in the cache, are never evicted and
+ * are skipped by bio_flush(), until the journal has committed them and
+ * calls bio_unhold(). After that they are ordinary dirty blocks and reach
+ * their place on disk with the next flush or eviction. If the cache runs
+ * out of buffers that are not held, writes go to the disk file directly.
+ */
+//Turn holding on or off, returns the number of cache buffers, 0 if there is no cache to hold blocks in
+int bio_hold(int on) {
+	if (bcache_size == 0)
+		return 0;
+	pthread_mutex_lock(&bio_mutex);
+	bcache_hold = on;
+	if (!on) {
+		for (int i = 0; i < bcache_size; i++)
+			bcache[i].held = 0;
+		bcache_nheld = 0;
+	}
+	pthread_mutex_unlock(&bio_mutex);
+	return bcache_size;
+}
+
+static int int_cmp(const void *a, const void *b) {
+	int x = *(const int *)a, y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+//Number of held blocks, their block numbers go to blocks in ascending order if it has room for them
+int bio_held(int *blocks, int max) {
+	int n;
+
+	pthread_mutex_lock(&bio_mutex);
+	n = bcache_nheld;
+	if (blocks != NULL && n <= max) {
+		int k = 0;
+		for (int i = 0; i < bcache_size; i++) {
+			if (bcache[i].held)
+				blocks[k++] = bcache[i].block_num;
+		}
+		qsort(blocks, k, sizeof(int), int_cmp);
+	}
+	pthread_mutex_unlock(&bio_mutex);
+	return n;
+}
+
+//Release the held blocks, they have been committed
+void bio_unhold() {
+	pthread_mutex_lock(&bio_mutex);
+	for (int i = 0; i < bcache_size; i++)
+		bcache[i].held = 0;
+	bcache_nheld = 0;
+	pthread_mutex_unlock(&bio_mutex);
+}
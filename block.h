@@ -8,12 +8,46 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/types.h>
+
 #define BLOCK_SIZE 4096
 
-void dev_init(const char* diskfile_path);
+void dev_init(const char* diskfile_path, off_t size);
 int dev_open(const char* diskfile_path);
 void dev_close();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_write_data(const int block_num, const void *buf);
+int bio_readv(const int block_num, int nblocks, void *buf);
+int bio_writev(const int block_num, int nblocks, const void *buf);
+void *bio_get(const int block_num);
+void bio_put(const int block_num, void *data, int dirty);
+void bio_readahead(const int block_num, int nblocks);
+
+// Block cache, see block.c
+int bio_cache_init(int nr_blocks);
+void bio_cache_free();
+void bio_cache_stats(unsigned long *hits, unsigned long *misses);
+int bio_flush();
+int bio_barrier();
+int bio_sync();
+
+// A run of consecutive disk blocks, see bio_sync_runs()
+struct bio_run {
+	int start;
+	int len;
+};
+
+int bio_flush_runs(struct bio_run *runs, int nruns);
+int bio_sync_runs(struct bio_run *runs, int nruns);
+
+// Holding blocks for the journal, see block.c and journal.c
+int bio_hold(int on);
+int bio_held(int *blocks, int max);
+void bio_unhold();
+
+// io_uring backend and memory mapped mode, see block.c
+int bio_uring_init();
+int bio_mmap_init();
 
 #endif
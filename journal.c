@@ -0,0 +1,407 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	journal.c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "block.h"
+#include "journal.h"
+
+/*
+ * Metadata journal
+ *
+ * FUSE operations run as transactions between journal_start() and
+ * journal_stop(). The metadata blocks they dirty are held in the block
+ * cache (bio_hold()) until a commit. A commit waits for the running
+ * operations to finish, then writes all held blocks to the journal region
+ * in one sequential write followed by one barrier. Many operations share
+ * a commit. One is made every commit interval, when the held blocks pass
+ * a threshold, on fsync and at unmount.
+ *
+ * The region starts with a struct journal_super. The rest is split into
+ * two halves that transactions use in turn. A transaction is its
+ * descriptor blocks, which list where each block belongs, then the blocks
+ * themselves, then a commit block with a checksum over both. Before
+ * transaction N is written the blocks of transaction N-1 are put in place,
+ * and prepare writes back the file data N's metadata points to for the
+ * first time (ordered data). Other dirty data stays in the cache. Once N
+ * is on disk, N-1 is no longer needed and its half is free for N+1.
+ * Recovery replays the newest complete transaction.
+ *
+ * Blocks a transaction frees are still referenced by the metadata on disk
+ * until it commits. The file system keeps them allocated until the done
+ * callback runs after the barrier, so file data never lands in them first.
+ */
+#define TAGS_PER_DESC ((BLOCK_SIZE - sizeof(struct journal_header)) / sizeof(uint32_t))
+
+static int jstart;						/* first block of the region */
+static int jblocks;						/* length of the region */
+static int jhalf;						/* blocks in each half */
+static int jmax;						/* most blocks one transaction can carry */
+static int jthreshold;					/* held blocks that start a commit */
+static uint32_t jseq;					/* sequence number of the next transaction */
+static int jactive;
+static void (*jprepare)(void);			/* moves cached metadata into the block cache */
+static void (*jdone)(void);				/* told when a commit is durable */
+static char *jbuf;						/* one half worth of blocks */
+static int *jtags;						/* jmax block numbers */
+static int *jprev;						/* blocks of the last transaction, not yet in place */
+static int jprev_n;
+static struct bio_run *jruns;			/* jmax runs for flushing jprev */
+
+// Running operations hold it for reading, a commit for writing
+static pthread_rwlock_t jlock;
+
+static pthread_t jthread;
+static pthread_mutex_t jthread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jthread_cond = PTHREAD_COND_INITIALIZER;
+static int jthread_stop;
+static int jinterval;					/* seconds between commits, 0 for none */
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(const void *buf, size_t len) {
+	const unsigned char *p = buf;
+	uint32_t crc = 0xFFFFFFFF;
+
+	if (crc_table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			crc_table[i] = c;
+		}
+	}
+	while (len-- > 0)
+		crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc ^ 0xFFFFFFFF;
+}
+
+//Descriptor blocks needed for n blocks
+static int desc_blocks(int n) {
+	return (n + TAGS_PER_DESC - 1) / TAGS_PER_DESC;
+}
+
+//First block of the half transaction seq goes to
+static int half_start(uint32_t seq) {
+	return jstart + 1 + (seq & 1) * jhalf;
+}
+
+static int geometry(int start, int blocks) {
+	if (blocks < JOURNAL_MIN_BLOCKS)
+		return -1;
+	jstart = start;
+	jblocks = blocks;
+	jhalf = (blocks - 1) / 2;
+	jmax = jhalf - 2;
+	while (jmax > 0 && desc_blocks(jmax) + jmax + 1 > jhalf)
+		jmax--;
+	if (jmax <= 0)
+		return -1;
+	free(jbuf);
+	free(jtags);
+	free(jprev);
+	free(jruns);
+	jbuf = malloc((size_t)jhalf * BLOCK_SIZE);
+	jtags = malloc(jmax * sizeof(int));
+	jprev = malloc(jmax * sizeof(int));
+	jruns = malloc(jmax * sizeof(struct bio_run));
+	jprev_n = 0;
+	return (jbuf == NULL || jtags == NULL || jprev == NULL || jruns == NULL) ? -1 : 0;
+}
+
+//Write the journal superblock straight to its place, it is never held
+static int write_super(uint32_t seq) {
+	struct journal_super *jsb;
+	char buf[BLOCK_SIZE];
+
+	memset(buf, 0, BLOCK_SIZE);
+	jsb = (struct journal_super *)buf;
+	jsb->magic = JOURNAL_MAGIC;
+	jsb->blocks = jblocks;
+	jsb->seq = seq;
+	return bio_writev(jstart, 1, buf);
+}
+
+//Set up an empty journal in blocks start .. start+blocks-1
+int journal_format(int start, int blocks) {
+	char buf[BLOCK_SIZE];
+
+	if (geometry(start, blocks) < 0)
+		return -1;
+	memset(buf, 0, BLOCK_SIZE);
+	bio_writev(half_start(0), 1, buf);
+	bio_writev(half_start(1), 1, buf);
+	jseq = 1;
+	return (write_super(jseq) < 0) ? -1 : 0;
+}
+
+/*
+ * Read the transaction in the half for parity into jbuf. Returns its
+ * block count if it is complete, has a sequence number of at least
+ * min_seq and its checksum matches, -1 otherwise.
+ */
+static int read_transaction(int parity, uint32_t min_seq, uint32_t *seq) {
+	struct journal_header *h = (struct journal_header *)jbuf;
+	int start = jstart + 1 + parity * jhalf;
+
+	if (bio_readv(start, 1, jbuf) < 0)
+		return -1;
+	if (h->magic != JOURNAL_MAGIC || h->type != JOURNAL_DESC || h->seq < min_seq ||
+		(h->seq & 1) != (uint32_t)parity || h->count == 0 || h->count > (uint32_t)jmax)
+		return -1;
+	*seq = h->seq;
+	int n = h->count;
+	int ndesc = desc_blocks(n);
+	if (bio_readv(start, ndesc + n + 1, jbuf) < 0)
+		return -1;
+	for (int d = 0; d < ndesc; d++) {
+		h = (struct journal_header *)(jbuf + (size_t)d * BLOCK_SIZE);
+		if (h->magic != JOURNAL_MAGIC || h->type != JOURNAL_DESC || h->seq != *seq || h->count != (uint32_t)n)
+			return -1;
+	}
+	h = (struct journal_header *)(jbuf + (size_t)(ndesc + n) * BLOCK_SIZE);
+	if (h->magic != JOURNAL_MAGIC || h->type != JOURNAL_COMMIT || h->seq != *seq || h->count != (uint32_t)n ||
+		h->checksum != crc32(jbuf, (size_t)(ndesc + n) * BLOCK_SIZE))
+		return -1;
+	return n;
+}
+
+//Block number of the i-th block of the transaction in jbuf
+static int tag(int i) {
+	char *desc = jbuf + (size_t)(i / TAGS_PER_DESC) * BLOCK_SIZE;
+	uint32_t *tags = (uint32_t *)(desc + sizeof(struct journal_header));
+	return tags[i % TAGS_PER_DESC];
+}
+
+/*
+ * Replay the newest complete transaction of the journal in blocks
+ * start .. start+blocks-1, and leave the journal empty. Runs before the
+ * file system reads any other metadata. Returns the number of blocks
+ * replayed, or -1 if there is no usable journal.
+ */
+int journal_recover(int start, int blocks) {
+	struct journal_super jsb;
+	char buf[BLOCK_SIZE];
+	uint32_t seq[2];
+	int n[2], best;
+
+	if (bio_readv(start, 1, buf) < 0)
+		return -1;
+	memcpy(&jsb, buf, sizeof(jsb));
+	if (jsb.magic != JOURNAL_MAGIC || jsb.blocks != (uint32_t)blocks || geometry(start, blocks) < 0) {
+		fprintf(stderr, "rufs: journal: bad journal superblock at block %d\n", start);
+		return -1;
+	}
+
+	// A transaction is complete once its commit block checks out; the
+	// newer of the two halves wins
+	n[0] = read_transaction(0, jsb.seq, &seq[0]);
+	n[1] = read_transaction(1, jsb.seq, &seq[1]);
+	best = (n[1] >= 0 && (n[0] < 0 || seq[1] > seq[0])) ? 1 : 0;
+	jseq = jsb.seq;
+	if (n[best] < 0)
+		return 0;
+	if (best == 0)
+		read_transaction(0, jsb.seq, &seq[0]);
+
+	int ndesc = desc_blocks(n[best]);
+	for (int i = 0; i < n[best]; i++)
+		bio_write(tag(i), jbuf + (size_t)(ndesc + i) * BLOCK_SIZE);
+	if (bio_sync() < 0)
+		return -1;
+	jseq = seq[best] + 1;
+	if (write_super(jseq) < 0 || bio_barrier() < 0)
+		return -1;
+	fprintf(stderr, "rufs: journal: replayed transaction %u, %d blocks\n", seq[best], n[best]);
+	return n[best];
+}
+
+//Write the blocks of the last transaction in place, they are sorted
+static int flush_prev() {
+	int n = 0;
+
+	for (int i = 0; i < jprev_n; i++) {
+		if (n > 0 && jruns[n - 1].start + jruns[n - 1].len == jprev[i])
+			jruns[n - 1].len++;
+		else
+			jruns[n++] = (struct bio_run){ jprev[i], 1 };
+	}
+	if (bio_flush_runs(jruns, n) < 0)
+		return -1;
+	jprev_n = 0;
+	return 0;
+}
+
+/*
+ * Write the held blocks as transaction jseq, jlock held for writing. A
+ * transaction too large for half the journal cannot be atomic; its
+ * blocks go straight to their place, and the sequence moves past what
+ * the journal holds so recovery cannot go back to it. Returns 1 once the
+ * blocks and all file data before them are durable, 0 if nothing was
+ * held.
+ */
+static int commit_locked() {
+	jprepare();
+	int n = bio_held(jtags, jmax);
+	if (n == 0) {
+		jdone();
+		return 0;
+	}
+	if (n > jmax) {
+		fprintf(stderr, "rufs: journal: %d blocks do not fit in one transaction, writing them in place\n", n);
+		bio_unhold();
+		jseq++;
+		jprev_n = 0;
+		if (bio_sync() < 0 || write_super(jseq) < 0 || bio_barrier() < 0)
+			return -1;
+		jdone();
+		return 1;
+	}
+
+	// Descriptor blocks, the blocks, the commit block
+	int ndesc = desc_blocks(n);
+	memset(jbuf, 0, (size_t)ndesc * BLOCK_SIZE);
+	for (int d = 0; d < ndesc; d++) {
+		char *desc = jbuf + (size_t)d * BLOCK_SIZE;
+		struct journal_header h = { JOURNAL_MAGIC, JOURNAL_DESC, jseq, n, 0 };
+		int first = d * TAGS_PER_DESC;
+		int count = (n - first < (int)TAGS_PER_DESC) ? n - first : (int)TAGS_PER_DESC;
+		memcpy(desc, &h, sizeof(h));
+		memcpy(desc + sizeof(h), jtags + first, count * sizeof(int));
+	}
+	for (int i = 0; i < n; i++) {
+		if (bio_read(jtags[i], jbuf + (size_t)(ndesc + i) * BLOCK_SIZE) < 0)
+			return -1;
+	}
+	char *commit = jbuf + (size_t)(ndesc + n) * BLOCK_SIZE;
+	struct journal_header h = { JOURNAL_MAGIC, JOURNAL_COMMIT, jseq, n, 0 };
+	h.checksum = crc32(jbuf, (size_t)(ndesc + n) * BLOCK_SIZE);
+	memset(commit, 0, BLOCK_SIZE);
+	memcpy(commit, &h, sizeof(h));
+
+	// The previous transaction goes in place first, then one write and
+	// one barrier make this transaction and the ordered data durable
+	if (flush_prev() < 0)
+		return -1;
+	if (bio_writev(half_start(jseq), ndesc + n + 1, jbuf) < 0 || bio_barrier() < 0)
+		return -1;
+	bio_unhold();
+	memcpy(jprev, jtags, n * sizeof(int));
+	jprev_n = n;
+	jseq++;
+	jdone();
+	return 1;
+}
+
+//Commit now, waiting for running operations to finish first, returns as commit_locked() does
+int journal_commit() {
+	int ret;
+
+	if (!jactive)
+		return 0;
+	pthread_rwlock_wrlock(&jlock);
+	ret = commit_locked();
+	pthread_rwlock_unlock(&jlock);
+	return ret;
+}
+
+void journal_start() {
+	if (jactive)
+		pthread_rwlock_rdlock(&jlock);
+}
+
+void journal_stop() {
+	if (!jactive)
+		return;
+	pthread_rwlock_unlock(&jlock);
+	if (bio_held(NULL, 0) >= jthreshold)
+		journal_commit();
+}
+
+//Commits every jinterval seconds
+static void *commit_thread(void *arg) {
+	pthread_mutex_lock(&jthread_mutex);
+	while (!jthread_stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += jinterval;
+		pthread_cond_timedwait(&jthread_cond, &jthread_mutex, &ts);
+		if (jthread_stop)
+			break;
+		pthread_mutex_unlock(&jthread_mutex);
+		journal_commit();
+		pthread_mutex_lock(&jthread_mutex);
+	}
+	pthread_mutex_unlock(&jthread_mutex);
+	return NULL;
+}
+
+/*
+ * Start journaling to the journal set up by journal_recover(). prepare is
+ * called at the start of every commit to write cached metadata, such as
+ * inodes and bitmaps, into the block cache, done after the commit is
+ * durable. Returns -1 if blocks cannot be held because there is no block
+ * cache.
+ */
+int journal_open(int interval, void (*prepare)(void), void (*done)(void)) {
+	pthread_rwlockattr_t attr;
+	int cache = bio_hold(1);
+
+	if (cache == 0 || jbuf == NULL)
+		return -1;
+	jprepare = prepare;
+	jdone = done;
+	jthreshold = (cache / 4 < jmax / 2) ? cache / 4 : jmax / 2;
+	if (jthreshold < 1)
+		jthreshold = 1;
+
+	// Commits must not wait behind a steady stream of operations
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&jlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	jactive = 1;
+
+	jinterval = interval;
+	jthread_stop = 0;
+	if (jinterval > 0 && pthread_create(&jthread, NULL, commit_thread, NULL) != 0)
+		jinterval = 0;
+	return 0;
+}
+
+//Commit what is left, put everything in place and leave the journal empty
+void journal_close() {
+	if (jactive) {
+		if (jinterval > 0) {
+			pthread_mutex_lock(&jthread_mutex);
+			jthread_stop = 1;
+			pthread_cond_signal(&jthread_cond);
+			pthread_mutex_unlock(&jthread_mutex);
+			pthread_join(jthread, NULL);
+		}
+		journal_commit();
+		bio_hold(0);
+		if (bio_sync() == 0 && write_super(jseq) >= 0)
+			bio_barrier();
+		jactive = 0;
+		pthread_rwlock_destroy(&jlock);
+	}
+	free(jbuf);
+	free(jtags);
+	free(jprev);
+	free(jruns);
+	jbuf = NULL;
+	jtags = NULL;
+	jprev = NULL;
+	jruns = NULL;
+}
@@ -0,0 +1,43 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	journal.h
+ *
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_MIN_BLOCKS 64			/* smaller journals are refused */
+
+/* Block 0 of the journal region */
+struct journal_super {
+	uint32_t	magic;				/* JOURNAL_MAGIC */
+	uint32_t	blocks;				/* length of the region, this block included */
+	uint32_t	seq;				/* transactions before this one are all in place */
+};
+
+/* Descriptor and commit blocks of a transaction start with this */
+#define JOURNAL_DESC	1			/* followed by the disk block numbers of the transaction */
+#define JOURNAL_COMMIT	2			/* ends a transaction */
+
+struct journal_header {
+	uint32_t	magic;				/* JOURNAL_MAGIC */
+	uint32_t	type;				/* JOURNAL_DESC or JOURNAL_COMMIT */
+	uint32_t	seq;				/* transaction sequence number */
+	uint32_t	count;				/* blocks in the transaction */
+	uint32_t	checksum;			/* commit only, crc32 of the descriptor and data blocks */
+};
+
+int journal_format(int start, int blocks);
+int journal_recover(int start, int blocks);
+int journal_open(int interval, void (*prepare)(void), void (*done)(void));
+void journal_close();
+void journal_start();
+void journal_stop();
+int journal_commit();
+
+#endif
@@ -15,57 +15,234 @@ NetId: htm23, mp1885
 
 #include <fuse.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <libgen.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "block.h"
+#include "journal.h"
 #include "rufs.h"
 
 char diskfile_path[PATH_MAX];
 
+// Mount options, parsed from -o in main()
+struct rufs_options {
+	int cache_blocks;		/* number of 4KB buffers in the block cache */
+	int inode_cache;		/* number of inodes kept in memory */
+	int dentry_cache;		/* number of cached name lookups, 0 disables */
+	int fixed_dirents;		/* mkfs with the original fixed size dirents */
+	int noextents;			/* mkfs with direct/indirect block pointers */
+	int io_uring;			/* do disk I/O through io_uring */
+	int mmap;				/* map the disk image instead of caching blocks */
+	int prealloc;			/* blocks reserved at a time for a growing file */
+	int size;				/* mkfs image size in MB, 0 for the default geometry */
+	int inodes;				/* mkfs inode count, 0 for one per 64KB of image */
+	int nogroups;			/* mkfs with one inode table and data region */
+	int noinline;			/* mkfs without inline data for small inodes */
+	int inode_size;			/* mkfs with 128 byte inodes, or 256 with nanosecond timestamps */
+	int migrate_inodes;		/* convert a 256 byte inode image to 128 at mount */
+	int atime;				/* ATIME_*, when reads update the access time */
+	int lazytime;			/* keep timestamp only changes in the inode cache */
+	int readahead;			/* largest readahead window in blocks, 0 disables */
+	int journal;			/* mkfs journal size in blocks, 0 for none */
+	int commit;				/* seconds between journal commits, 0 for none */
+};
+
+#define ATIME_STRICT	0		/* every read */
+#define ATIME_RELATIVE	1		/* when atime is older than mtime, or a day old */
+#define ATIME_NONE		2		/* never */
+
+struct rufs_options rufs_opts = {
+	.cache_blocks = 2048,
+	.inode_cache = 1024,
+	.dentry_cache = 4096,
+	.prealloc = 16,
+	.inode_size = 128,
+	.atime = ATIME_RELATIVE,
+	.readahead = 64,
+	.journal = 1024,
+	.commit = 5,
+};
+
+#define RUFS_OPT(t, p, v) { t, offsetof(struct rufs_options, p), v }
+static struct fuse_opt rufs_opt_spec[] = {
+	RUFS_OPT("cache_blocks=%d", cache_blocks, 0),
+	RUFS_OPT("inode_cache=%d", inode_cache, 0),
+	RUFS_OPT("dentry_cache=%d", dentry_cache, 0),
+	RUFS_OPT("fixed_dirents", fixed_dirents, 1),
+	RUFS_OPT("noextents", noextents, 1),
+	RUFS_OPT("io_uring", io_uring, 1),
+	RUFS_OPT("mmap", mmap, 1),
+	RUFS_OPT("prealloc=%d", prealloc, 0),
+	RUFS_OPT("size=%d", size, 0),
+	RUFS_OPT("inodes=%d", inodes, 0),
+	RUFS_OPT("nogroups", nogroups, 1),
+	RUFS_OPT("noinline", noinline, 1),
+	RUFS_OPT("inode_size=%d", inode_size, 0),
+	RUFS_OPT("migrate_inodes", migrate_inodes, 1),
+	RUFS_OPT("strictatime", atime, ATIME_STRICT),
+	RUFS_OPT("relatime", atime, ATIME_RELATIVE),
+	RUFS_OPT("noatime", atime, ATIME_NONE),
+	RUFS_OPT("lazytime", lazytime, 1),
+	RUFS_OPT("readahead=%d", readahead, 0),
+	RUFS_OPT("journal=%d", journal, 0),
+	RUFS_OPT("commit=%d", commit, 0),
+	FUSE_OPT_END
+};
+
 
 // Declare your in-memory data structures here
 struct superblock *my_super_block;
 int num_free_blocks;
+int num_free_inodes;
 unsigned char *inode_bitmap;
 unsigned char *data_bitmap;
-int inode_bitmap_len;
-int data_bitmap_len;
-void *data_blk;
-void *data_blk2;
-void *data_blk3;
+int inode_bitmap_len;		/* bytes, whole blocks from i_bitmap_blk on */
+int data_bitmap_len;		/* bytes, whole blocks from d_bitmap_blk on */
 int debugOuter = 0;
 int debugInner = 0;
 
+// Protects inode_bitmap, data_bitmap, their dirty maps and the free counts
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One bit per bitmap block changed since bitmaps_store() last wrote it
+static bitmap_t imap_dirty;
+static bitmap_t dmap_dirty;
+static int imap_blocks;
+static int dmap_blocks;
+
+/*
+ * Blocks of the preallocation windows, see ialloc_blkno(). They are set in
+ * data_bitmap so nothing else takes them, and in pa_bitmap, which
+ * bitmaps_store() masks out: on disk they stay free, because the windows
+ * live only in memory and would leak after a crash. pa_blocks counts them.
+ */
+static bitmap_t pa_bitmap;
+static int pa_blocks;
+
+/*
+ * Blocks freed by the running transaction. Until it has committed, the
+ * committed metadata may still point at them, so they stay set in
+ * data_bitmap and nothing can reuse them. bitmaps_store() writes them as
+ * free and free_commit() gives them back once the commit is durable.
+ * Without a journal (journaling 0) blocks are freed at once.
+ */
+static bitmap_t free_pending;
+static bitmap_t pend_map;				/* one bit per data bitmap block with pending bits */
+static int pending_blocks;
+static int journaling;					/* the journal is open */
+
+/*
+ * Blocks allocated by the running transaction. Its metadata points at
+ * them for the first time, so their data must be on disk before it
+ * commits (ordered data, see ordered_flush()). Data written to blocks a
+ * file already had may stay in the cache.
+ */
+static bitmap_t ordered_bitmap;
+static bitmap_t ordered_map;			/* one bit per data bitmap block with ordered bits */
+
+// Note a new block for ordered_flush(), called with alloc_lock held
+static void ordered_mark(int index) {
+	if(!journaling)
+		return;
+	set_bitmap(ordered_bitmap, index);
+	set_bitmap(ordered_map, index / (BLOCK_SIZE * 8));
+}
+
+/*
+ * Scratch block buffers. Each FUSE worker thread gets its own set, so
+ * operations running in parallel never share them.
+ */
+static __thread char scratch_blk[3][BLOCK_SIZE] __attribute__((aligned(8)));
+#define data_blk ((void *)scratch_blk[0])
+#define data_blk2 ((void *)scratch_blk[1])
+#define data_blk3 ((void *)scratch_blk[2])
+
+// Next-fit cursors, allocation without a goal resumes where the last one ended
+static int ino_cursor;
+static int blk_cursor;
+
+/*
+ * Block groups (SB_FEAT_GROUPS). The image is cut into groups of
+ * blocks_per_group blocks, each laid out like a small file system: a copy
+ * of the superblock, an inode bitmap block, a data bitmap block, an inode
+ * table and data blocks, at the superblock's *_blk offsets from the start
+ * of the group. Files get their inode and blocks in the group of their
+ * directory, directories go to the group with the most free inodes.
+ *
+ * In memory the inode bitmap is indexed by inode number in both layouts.
+ * Bit i of the data bitmap is block dmap_base + i, where dmap_base is
+ * d_start_blk for the flat layout and 0 with groups (the metadata blocks
+ * of each group are marked used).
+ */
+#define GROUPED (my_super_block->features & SB_FEAT_GROUPS)
+
+static int dmap_base;
+static int groups_count;
+static int *group_free_inodes;		/* protected by alloc_lock */
+
+static int group_start(int group) {
+	return group * my_super_block->blocks_per_group;
+}
+
+// Mark the inode bitmap block holding ino dirty, called with alloc_lock held
+static void imap_mark(int ino) {
+	int per_blk = GROUPED ? (int)my_super_block->inodes_per_group : BLOCK_SIZE * 8;
+	set_bitmap(imap_dirty, ino / per_blk);
+}
+
+// Same for bit index of the data bitmap, a data bitmap block maps a group
+static void dmap_mark(int index) {
+	set_bitmap(dmap_dirty, index / (BLOCK_SIZE * 8));
+}
+
+/*
+ * Take the first clear bit at or after start, wrapping around to the
+ * beginning of the map. Called with alloc_lock held.
+ */
+static int bitmap_alloc(bitmap_t b, int nbits, int start) {
+	if(start < 0 || start >= nbits)
+		start = 0;
+	int index = find_zero_bit(b, start, nbits);
+	if(index < 0 && start > 0)
+		index = find_zero_bit(b, 0, start);
+	if(index >= 0)
+		set_bitmap(b, index);
+	return index;
+}
+
 /* 
  * Get available inode number from bitmap
  */
-int get_avail_ino() {
+int get_avail_ino_near(int goal) {
 
 	// Step 1: Read inode bitmap from disk
 	// Alread Read at INIT
 
-	// Step 2: Traverse inode bitmap to find an available slot
-	int bit;
-	int index = 0;
-	do{
-		bit = get_bitmap(inode_bitmap, index);
-		if(bit == 0){
-			//set bit as used
-			set_bitmap(inode_bitmap, index);
-		}
-		index++;
-	}while(bit != 0 && index-1 < MAX_INUM);
+	// Step 2: Search inode bitmap for an available slot from goal or the cursor on
+	pthread_mutex_lock(&alloc_lock);
+	int index = bitmap_alloc(inode_bitmap, my_super_block->inodes_count, (goal >= 0) ? goal : ino_cursor);
+	if(index >= 0 && goal < 0)
+		ino_cursor = index + 1;
+	if(index >= 0){
+		imap_mark(index);
+		num_free_inodes--;
+	}
+	if(index >= 0 && GROUPED)
+		group_free_inodes[index / my_super_block->inodes_per_group]--;
+	pthread_mutex_unlock(&alloc_lock);
 
-	if(index-1 >= MAX_INUM){
+	if(index < 0){
 		perror("No more blocks available for inode");
 		return -1;
 	}
@@ -73,524 +250,2896 @@ int get_avail_ino() {
 	// Step 3: Update inode bitmap and write to disk
 	// Write Handled in rufs_destroy
 
-	return index-1;
+	return index;
 }
 
-/* 
- * Get available data block number from bitmap
+int get_avail_ino() {
+	return get_avail_ino_near(-1);
+}
+
+/*
+ * Where to look for a new inode in dir_inode: the directory's own group
+ * for a file, the group with the most free inodes for a directory so that
+ * directory trees spread out. Returns an inode number to search from, -1
+ * without block groups.
  */
-int get_avail_blkno() {
-	
+int ialloc_goal(struct inode *dir_inode, int is_dir) {
+	if(!GROUPED)
+		return -1;
+	int ipg = my_super_block->inodes_per_group;
+	if(!is_dir)
+		return dir_inode->ino / ipg * ipg;
+	int best = 0;
+	pthread_mutex_lock(&alloc_lock);
+	for(int g=1; g<groups_count; g++){
+		if(group_free_inodes[g] > group_free_inodes[best])
+			best = g;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return best * ipg;
+}
+
+/*
+ * Get available data block number from bitmap, searching from block goal
+ * on so that files grow contiguously on disk. Without a goal (-1) the
+ * search starts at the next-fit cursor.
+ */
+int get_avail_blkno_near(int goal) {
+
 	// Step 1: Read data block bitmap from disk
 	// Alread Read at INIT
 
-	// Step 2: Traverse data block bitmap to find an available slot
-	int bit;
-	int index = 0;
-	do{
-		bit = get_bitmap(data_bitmap, index);
-		if(bit == 0){
-			//set bit as used
-			set_bitmap(data_bitmap, index);
-		}
-		index++;
-	}while(bit != 0 && (my_super_block->d_start_blk + index - 1) < MAX_DNUM);
+	// Step 2: Search data block bitmap for an available slot
+	int nbits = (int)my_super_block->blocks_count - dmap_base;
+	int use_goal = (goal >= dmap_base && goal < (int)my_super_block->blocks_count);
+	pthread_mutex_lock(&alloc_lock);
+	int index = bitmap_alloc(data_bitmap, nbits, use_goal ? goal - dmap_base : blk_cursor);
+	if(index >= 0 && !use_goal)
+		blk_cursor = index + 1;
+	if(index >= 0){
+		dmap_mark(index);
+		ordered_mark(index);
+		num_free_blocks--;
+	}
+	pthread_mutex_unlock(&alloc_lock);
 
-	if(my_super_block->d_start_blk + index - 1 >= MAX_DNUM){
+	if(index < 0){
 		perror("No more blocks available for data");
 		return -1;
 	}
-	
+
 	// Step 3: Update data block bitmap and write to disk
 	// Write Handled in rufs_destroy
 
-	return my_super_block->d_start_blk + index - 1;
+	return dmap_base + index;
+}
+
+/* 
+ * Get available data block number from bitmap
+ */
+int get_avail_blkno() {
+	return get_avail_blkno_near(-1);
+}
+
+/*
+ * Allocate up to want contiguous blocks, the first one found the same way
+ * as get_avail_blkno_near(goal). Returns the first block and sets *got to
+ * the number of blocks taken. With window set the blocks after the first
+ * are a preallocation window, marked in pa_bitmap in the same step.
+ */
+int get_avail_blkno_run(int goal, int want, int window, int *got) {
+	int nbits = (int)my_super_block->blocks_count - dmap_base;
+	int use_goal = (goal >= dmap_base && goal < (int)my_super_block->blocks_count);
+	int n = 1;
+	pthread_mutex_lock(&alloc_lock);
+	int index = bitmap_alloc(data_bitmap, nbits, use_goal ? goal - dmap_base : blk_cursor);
+	if(index >= 0){
+		while(n < want && index + n < nbits && get_bitmap(data_bitmap, index + n) == 0){
+			set_bitmap(data_bitmap, index + n);
+			if(window)
+				set_bitmap(pa_bitmap, index + n);
+			n++;
+		}
+		if(window)
+			pa_blocks += n - 1;
+		if(!use_goal)
+			blk_cursor = index + n;
+		for(int i = index; i < index + (window ? 1 : n); i++)
+			ordered_mark(i);
+		dmap_mark(index);
+		dmap_mark(index + n - 1);
+		num_free_blocks -= n;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	if(index < 0){
+		perror("No more blocks available for data");
+		return -1;
+	}
+	*got = n;
+	return dmap_base + index;
+}
+
+/*
+ * Give a data block back to the free pool
+ */
+void release_blkno(int blk_num) {
+	int index = blk_num - dmap_base;
+	pthread_mutex_lock(&alloc_lock);
+	if(journaling){
+		set_bitmap(free_pending, index);
+		set_bitmap(pend_map, index / (BLOCK_SIZE * 8));
+		pending_blocks++;
+	}
+	else{
+		unset_bitmap(data_bitmap, index);
+		num_free_blocks++;
+	}
+	dmap_mark(index);
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Give n contiguous data blocks back to the free pool. Their bits are
+ * cleared a 64-bit word at a time where the run covers whole words.
+ */
+void release_blkno_run(int blk_num, int n) {
+	int index = blk_num - dmap_base;
+	pthread_mutex_lock(&alloc_lock);
+	if(journaling){
+		set_bitmap_range(free_pending, index, n);
+		pending_blocks += n;
+	}
+	else{
+		clear_bitmap_range(data_bitmap, index, n);
+		num_free_blocks += n;
+	}
+	for(int b = index / (BLOCK_SIZE * 8); b <= (index + n - 1) / (BLOCK_SIZE * 8); b++){
+		set_bitmap(dmap_dirty, b);
+		if(journaling)
+			set_bitmap(pend_map, b);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Called by the journal once a commit is durable: the blocks its
+ * transaction freed are no longer referenced on disk and can be reused.
+ * Their bits are already clear in the stored bitmap blocks.
+ */
+static void free_commit() {
+	pthread_mutex_lock(&alloc_lock);
+	for(int i=0; pending_blocks > 0 && i<dmap_blocks; i++){
+		if(!get_bitmap(pend_map, i))
+			continue;
+		unset_bitmap(pend_map, i);
+		for(int j=i*BLOCK_SIZE; j<(i+1)*BLOCK_SIZE; j++)
+			data_bitmap[j] &= ~free_pending[j];
+		memset(free_pending + i*BLOCK_SIZE, 0, BLOCK_SIZE);
+	}
+	num_free_blocks += pending_blocks;
+	pending_blocks = 0;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+// Block blk_num of a window goes to a file, from now on it is stored as used
+void take_prealloc(int blk_num) {
+	pthread_mutex_lock(&alloc_lock);
+	unset_bitmap(pa_bitmap, blk_num - dmap_base);
+	dmap_mark(blk_num - dmap_base);
+	ordered_mark(blk_num - dmap_base);
+	pa_blocks--;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Give the n unused blocks of a window back to the free pool. They are
+ * stored as free already, so no bitmap block becomes dirty.
+ */
+void release_prealloc_run(int blk_num, int n) {
+	int index = blk_num - dmap_base;
+	pthread_mutex_lock(&alloc_lock);
+	clear_bitmap_range(pa_bitmap, index, n);
+	clear_bitmap_range(data_bitmap, index, n);
+	pa_blocks -= n;
+	num_free_blocks += n;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Give an inode number back to the free pool
+ */
+void release_ino(int ino) {
+	pthread_mutex_lock(&alloc_lock);
+	unset_bitmap(inode_bitmap, ino);
+	imap_mark(ino);
+	num_free_inodes++;
+	if(GROUPED)
+		group_free_inodes[ino / my_super_block->inodes_per_group]++;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Data blocks in use, from the free count kept by the allocator. The
+ * metadata blocks of groups and the journal are marked used in the data
+ * bitmap too; their number is fixed at mkfs and is left out.
+ */
+int get_blocks_used() {
+	int fixed = GROUPED ? groups_count * my_super_block->d_start_blk : 0;
+	if(my_super_block->features & SB_FEAT_JOURNAL)
+		fixed += my_super_block->journal_blocks;
+
+	pthread_mutex_lock(&alloc_lock);
+	int used = (int)my_super_block->blocks_count - dmap_base - num_free_blocks;
+	pthread_mutex_unlock(&alloc_lock);
+	return used - fixed;
+}
+
+/* 
+ * In-memory inode cache
+ *
+ * Inodes are looked up by number and pinned with iget() while an operation
+ * uses them, then released with iput(). Updates are made to the cached copy
+ * and flagged with imark_dirty(); dirty inodes are written back one inode
+ * block at a time, so inodes sharing a block cost a single block update.
+ *
+ * icache_lock protects the cache itself. The contents of a pinned inode,
+ * and for directories the directory blocks, are protected by the entry's
+ * rwlock, taken with irlock()/iwlock() and dropped with iunlock() before
+ * iput(). An operation holding two of them locks the child before the
+ * parent. A miss reads the inode block without icache_lock, see iget().
+ */
+#define INODES_PER_BLK (BLOCK_SIZE/inode_size)
+
+// Bytes per on-disk inode, sizeof(struct dinode) with SB_FEAT_COMPACT_INODE
+static int inode_size = sizeof(struct dinode);
+
+// The inode size the superblock's features say
+static int dinode_size() {
+	if(!(my_super_block->features & SB_FEAT_COMPACT_INODE))
+		return sizeof(struct dinode_v1);
+	if(my_super_block->features & SB_FEAT_LARGE_INODE)
+		return sizeof(struct dinode_large);
+	return sizeof(struct dinode);
+}
+
+/*
+ * Convert between the in-memory inode and the on-disk formats. The
+ * original format keeps a struct stat of which only the fields below were
+ * ever set; images made before ctime was kept have none.
+ */
+static void dinode_load_v1(struct inode *inode, const void *raw, uint32_t ino) {
+	const struct dinode_v1 *d = raw;
+	memset(inode, 0, sizeof(struct inode));
+	inode->ino = ino;
+	inode->valid = d->valid;
+	inode->flags = d->flags;
+	inode->link = d->link;
+	inode->type = d->vstat.st_mode ? d->vstat.st_mode : d->type;
+	inode->size = d->size;
+	inode->uid = d->vstat.st_uid;
+	inode->gid = d->vstat.st_gid;
+	inode->atime = d->vstat.st_atim;
+	inode->mtime = d->vstat.st_mtim;
+	inode->ctime = d->vstat.st_ctime ? d->vstat.st_ctim : d->vstat.st_mtim;
+	memcpy(inode->i_block, d->i_block, sizeof(inode->i_block));
+}
+
+static void dinode_store_v1(void *raw, const struct inode *inode) {
+	struct dinode_v1 *d = raw;
+	memset(d, 0, sizeof(struct dinode_v1));
+	d->ino = inode->ino;
+	d->valid = inode->valid;
+	d->flags = inode->flags;
+	d->size = inode->size;
+	d->type = inode->type;
+	d->link = inode->link;
+	memcpy(d->i_block, inode->i_block, sizeof(d->i_block));
+	d->vstat.st_mode = inode->type;
+	d->vstat.st_nlink = inode->link;
+	d->vstat.st_uid = inode->uid;
+	d->vstat.st_gid = inode->gid;
+	d->vstat.st_size = inode->size;
+	d->vstat.st_blksize = BLOCK_SIZE;
+	d->vstat.st_atim = inode->atime;
+	d->vstat.st_mtim = inode->mtime;
+	d->vstat.st_ctim = inode->ctime;
+}
+
+static void dinode_load_v2(struct inode *inode, const void *raw, uint32_t ino) {
+	const struct dinode *d = raw;
+	memset(inode, 0, sizeof(struct inode));
+	inode->ino = ino;
+	inode->valid = d->valid;
+	inode->flags = d->flags;
+	inode->link = d->links;
+	inode->type = d->mode;
+	inode->size = d->size;
+	inode->uid = d->uid;
+	inode->gid = d->gid;
+	inode->atime.tv_sec = d->atime;
+	inode->mtime.tv_sec = d->mtime;
+	inode->ctime.tv_sec = d->ctime;
+	if(d->version < 3){
+		// Version 2 has the nanoseconds of mtime where ctime is now
+		inode->mtime.tv_nsec = d->ctime;
+		inode->ctime = inode->mtime;
+	}
+	memcpy(inode->i_block, d->i_block, sizeof(inode->i_block));
+}
+
+static void dinode_store_v2(void *raw, const struct inode *inode) {
+	struct dinode *d = raw;
+	d->mode = inode->type;
+	d->links = (inode->link > UINT16_MAX) ? UINT16_MAX : inode->link;
+	d->valid = inode->valid;
+	d->flags = inode->flags;
+	d->version = DINODE_VERSION;
+	d->size = inode->size;
+	d->uid = inode->uid;
+	d->gid = inode->gid;
+	d->atime = inode->atime.tv_sec;
+	d->mtime = inode->mtime.tv_sec;
+	d->ctime = inode->ctime.tv_sec;
+	memcpy(d->i_block, inode->i_block, sizeof(d->i_block));
+}
+
+static void dinode_load_large(struct inode *inode, const void *raw, uint32_t ino) {
+	const struct dinode_large *d = raw;
+	dinode_load_v2(inode, &d->d, ino);
+	inode->atime.tv_nsec = d->atime_nsec;
+	inode->mtime.tv_nsec = d->mtime_nsec;
+	inode->ctime.tv_nsec = d->ctime_nsec;
+}
+
+static void dinode_store_large(void *raw, const struct inode *inode) {
+	struct dinode_large *d = raw;
+	dinode_store_v2(&d->d, inode);
+	d->atime_nsec = inode->atime.tv_nsec;
+	d->mtime_nsec = inode->mtime.tv_nsec;
+	d->ctime_nsec = inode->ctime.tv_nsec;
+}
+
+static void dinode_load(struct inode *inode, const void *raw, uint32_t ino) {
+	if(my_super_block->features & SB_FEAT_LARGE_INODE)
+		dinode_load_large(inode, raw, ino);
+	else if(my_super_block->features & SB_FEAT_COMPACT_INODE)
+		dinode_load_v2(inode, raw, ino);
+	else
+		dinode_load_v1(inode, raw, ino);
+}
+
+static void dinode_store(void *raw, const struct inode *inode) {
+	if(my_super_block->features & SB_FEAT_LARGE_INODE)
+		dinode_store_large(raw, inode);
+	else if(my_super_block->features & SB_FEAT_COMPACT_INODE)
+		dinode_store_v2(raw, inode);
+	else
+		dinode_store_v1(raw, inode);
+}
+
+struct icache_entry {
+	struct inode inode;					/* cached inode, must be first */
+	int ino;							/* inode number, -1 if unused */
+	int pins;							/* iget() references held */
+	int dirty;							/* cached copy is newer than disk */
+	int lazy;							/* only timestamps are newer, see imark_time() */
+	int loading;						/* being read from disk, see iget() */
+	int pa_start, pa_len;				/* preallocated blocks, see ialloc_blkno() */
+	unsigned map_gen;					/* bumped by imark_dirty(), see file_blkno_run() */
+	unsigned free_gen;					/* bumped when the inode is freed, see file_iget() */
+	pthread_rwlock_t lock;				/* irlock()/iwlock() */
+	struct icache_entry *hnext;			/* hash chain */
+	struct icache_entry *prev, *next;	/* LRU list, head is most recent */
+};
+
+static struct icache_entry *icache;
+static struct icache_entry **icache_hash;
+static struct icache_entry *ilru_head, *ilru_tail;
+static int icache_size;
+static int icache_buckets;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t icache_cond = PTHREAD_COND_INITIALIZER;	/* an entry finished loading */
+
+static int icache_init(int nr_inodes) {
+	if(nr_inodes < 16)
+		nr_inodes = 16;
+	icache_buckets = 1;
+	while(icache_buckets < nr_inodes)
+		icache_buckets <<= 1;
+	icache = calloc(nr_inodes, sizeof(struct icache_entry));
+	icache_hash = calloc(icache_buckets, sizeof(struct icache_entry *));
+	if(icache == NULL || icache_hash == NULL){
+		perror("icache_init failed");
+		return -1;
+	}
+	for(int i=0; i<nr_inodes; i++){
+		icache[i].ino = -1;
+		pthread_rwlock_init(&icache[i].lock, NULL);
+		icache[i].prev = (i > 0) ? &icache[i-1] : NULL;
+		icache[i].next = (i < nr_inodes-1) ? &icache[i+1] : NULL;
+	}
+	ilru_head = &icache[0];
+	ilru_tail = &icache[nr_inodes-1];
+	icache_size = nr_inodes;
+	return 0;
+}
+
+static void discard_prealloc(struct icache_entry *e);
+
+static void icache_free() {
+	for(int i=0; i<icache_size; i++){
+		discard_prealloc(&icache[i]);
+		pthread_rwlock_destroy(&icache[i].lock);
+	}
+	free(icache);
+	free(icache_hash);
+	icache = NULL;
+	icache_hash = NULL;
+	icache_size = 0;
+}
+
+static struct icache_entry *icache_lookup(int ino) {
+	struct icache_entry *e = icache_hash[ino & (icache_buckets-1)];
+	while(e != NULL && e->ino != ino)
+		e = e->hnext;
+	return e;
+}
+
+static void icache_unhash(struct icache_entry *e) {
+	struct icache_entry **pp = &icache_hash[e->ino & (icache_buckets-1)];
+	while(*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+}
+
+static void icache_touch(struct icache_entry *e) {
+	if(ilru_head == e)
+		return;
+	e->prev->next = e->next;
+	if(e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		ilru_tail = e->prev;
+	e->prev = NULL;
+	e->next = ilru_head;
+	ilru_head->prev = e;
+	ilru_head = e;
+}
+
+// Disk block of the inode table holding inode ino
+static int inode_blkno(int ino) {
+	if(GROUPED){
+		int ipg = my_super_block->inodes_per_group;
+		return group_start(ino / ipg) + my_super_block->i_start_blk + (ino % ipg)/INODES_PER_BLK;
+	}
+	return my_super_block->i_start_blk + ino/INODES_PER_BLK;
+}
+
+/*
+ * Write back every dirty cached inode that lives in the same inode block as ino
+ */
+static int iflush_block(int ino) {
+	int first_ino = ino - ino % INODES_PER_BLK;
+	int i_blk_num = inode_blkno(ino);
+	char *buf = bio_get(i_blk_num);
+
+	if(buf == NULL)
+		return -EIO;
+	for(int i=0; i<INODES_PER_BLK; i++){
+		struct icache_entry *e = icache_lookup(first_ino + i);
+		if(e != NULL && (e->dirty || e->lazy)){
+			dinode_store(buf + i*inode_size, &e->inode);
+			e->dirty = 0;
+			e->lazy = 0;
+		}
+	}
+	bio_put(i_blk_num, buf, 1);
+	return 0;
+}
+
+/*
+ * Write back all dirty inodes, and with lazy also those whose timestamps
+ * alone changed
+ */
+int iflush(int lazy) {
+	int ret = 0;
+	pthread_mutex_lock(&icache_lock);
+	for(int i=0; i<icache_size; i++){
+		if(icache[i].ino >= 0 && (icache[i].dirty || (lazy && icache[i].lazy))){
+			if(iflush_block(icache[i].ino) < 0)
+				ret = -EIO;
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return ret;
+}
+
+/*
+ * Write back one inode, with the others of its inode block, and with lazy
+ * also when only its timestamps changed. Returns the disk block of the
+ * inode.
+ */
+int iflush_inode(struct inode *inode, int lazy) {
+	struct icache_entry *e = (struct icache_entry *)inode;
+	int ret = 0;
+	pthread_mutex_lock(&icache_lock);
+	if(e->dirty || (lazy && e->lazy))
+		ret = iflush_block(e->ino);
+	pthread_mutex_unlock(&icache_lock);
+	return (ret < 0) ? -EIO : inode_blkno(e->ino);
+}
+
+/*
+ * Get a pinned pointer to the cached inode, reading it from disk on a miss.
+ * The read runs without icache_lock: the entry is published first, pinned
+ * and marked loading, and other lookups of the same inode wait for it.
+ */
+struct inode *iget(uint32_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e = icache_lookup(ino);
+	if(e == NULL){
+		// Reuse the least recently used unpinned entry
+		e = ilru_tail;
+		while(e != NULL && e->pins > 0)
+			e = e->prev;
+		if(e == NULL){
+			pthread_mutex_unlock(&icache_lock);
+			perror("No free inode cache entries");
+			return NULL;
+		}
+		if(e->ino >= 0){
+			if((e->dirty || e->lazy) && iflush_block(e->ino) < 0){
+				pthread_mutex_unlock(&icache_lock);
+				return NULL;
+			}
+			discard_prealloc(e);
+			icache_unhash(e);
+		}
+
+		// Step 1: Get the inode's on-disk block number
+		int i_blk_num = inode_blkno(ino);
+
+		// Step 2: Get offset of the inode in the inode on-disk block
+		int offset = (ino % INODES_PER_BLK)*inode_size;
+
+		// Step 3: Publish the entry as loading, then read the block from
+		// disk without icache_lock and copy the inode into the entry
+		e->ino = ino;
+		e->dirty = 0;
+		e->lazy = 0;
+		e->loading = 1;
+		e->pins = 1;
+		e->hnext = icache_hash[ino & (icache_buckets-1)];
+		icache_hash[ino & (icache_buckets-1)] = e;
+		icache_touch(e);
+		pthread_mutex_unlock(&icache_lock);
+
+		char *buf = bio_get(i_blk_num);
+		if(buf != NULL){
+			dinode_load(&e->inode, buf + offset, ino);
+			bio_put(i_blk_num, buf, 0);
+		}
+
+		pthread_mutex_lock(&icache_lock);
+		e->loading = 0;
+		pthread_cond_broadcast(&icache_cond);
+		if(buf == NULL){
+			icache_unhash(e);
+			e->ino = -1;
+			e->pins--;
+			pthread_mutex_unlock(&icache_lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&icache_lock);
+		return &e->inode;
+	}
+
+	// A hit on an entry still loading waits for the read, which may fail
+	e->pins++;
+	while(e->loading)
+		pthread_cond_wait(&icache_cond, &icache_lock);
+	if(e->ino != (int)ino){
+		e->pins--;
+		pthread_mutex_unlock(&icache_lock);
+		return NULL;
+	}
+	icache_touch(e);
+	pthread_mutex_unlock(&icache_lock);
+	return &e->inode;
+}
+
+void iput(struct inode *inode) {
+	struct icache_entry *e = (struct icache_entry *)inode;
+	pthread_mutex_lock(&icache_lock);
+	if(e->pins > 0)
+		e->pins--;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+void imark_dirty(struct inode *inode) {
+	struct icache_entry *e = (struct icache_entry *)inode;
+	// Only inodes handed out by iget() live in the cache
+	if(e >= icache && e < icache + icache_size){
+		pthread_mutex_lock(&icache_lock);
+		e->dirty = 1;
+		__atomic_add_fetch(&e->map_gen, 1, __ATOMIC_RELAXED);
+		if(!inode->valid)
+			__atomic_add_fetch(&e->free_gen, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&icache_lock);
+	}
+}
+
+/*
+ * Flag an inode whose only change is a timestamp. With -o lazytime it is
+ * not dirty: it goes to disk along with its inode block, when it leaves
+ * the cache or at unmount, but not on fsync.
+ */
+void imark_time(struct inode *inode) {
+	struct icache_entry *e = (struct icache_entry *)inode;
+	if(!rufs_opts.lazytime){
+		imark_dirty(inode);
+		return;
+	}
+	if(e >= icache && e < icache + icache_size){
+		pthread_mutex_lock(&icache_lock);
+		e->lazy = 1;
+		pthread_mutex_unlock(&icache_lock);
+	}
+}
+
+/*
+ * Update the access time after the inode's data was read, as the atime
+ * option says. Callers may hold only the read lock, so atime is stored
+ * atomically; mtime cannot change under the read lock.
+ */
+void iaccessed(struct inode *inode) {
+	time_t now = time(NULL);
+	time_t atime = __atomic_load_n(&inode->atime.tv_sec, __ATOMIC_RELAXED);
+
+	if(rufs_opts.atime == ATIME_NONE)
+		return;
+	if(rufs_opts.atime == ATIME_RELATIVE && atime >= inode->mtime.tv_sec && now - atime < 24*60*60)
+		return;
+	__atomic_store_n(&inode->atime.tv_sec, now, __ATOMIC_RELAXED);
+	imark_time(inode);
+}
+
+/*
+ * Lock a pinned inode for reading or for writing
+ */
+void irlock(struct inode *inode) {
+	pthread_rwlock_rdlock(&((struct icache_entry *)inode)->lock);
+}
+
+void iwlock(struct inode *inode) {
+	pthread_rwlock_wrlock(&((struct icache_entry *)inode)->lock);
+}
+
+void iunlock(struct inode *inode) {
+	pthread_rwlock_unlock(&((struct icache_entry *)inode)->lock);
+}
+
+/*
+ * Preallocation. When a regular file needs a block, the allocator reserves
+ * a run of up to prealloc blocks; the first is used and the rest stay
+ * marked in the in-memory bitmap as the inode's window. Later blocks that
+ * continue the file come from the window, so files written side by side
+ * do not interleave on disk. Unused blocks are given back on release,
+ * unlink, eviction from the inode cache and unmount. The window lives only
+ * in memory and is protected by the inode's write lock. Its blocks are
+ * written to disk as free (pa_bitmap), so a crash cannot leak them.
+ */
+static void discard_prealloc(struct icache_entry *e) {
+	if(e->pa_len > 0)
+		release_prealloc_run(e->pa_start, e->pa_len);
+	e->pa_len = 0;
+}
+
+void idiscard_prealloc(struct inode *inode) {
+	struct icache_entry *e = (struct icache_entry *)inode;
+	if(e >= icache && e < icache + icache_size)
+		discard_prealloc(e);
+}
+
+// First data block of the group holding inode, -1 without block groups
+static int inode_blk_goal(struct inode *inode) {
+	if(!GROUPED)
+		return -1;
+	return group_start(inode->ino / my_super_block->inodes_per_group) + my_super_block->d_start_blk;
+}
+
+/*
+ * Allocate a block for inode, aiming for goal (-1 for none, which means
+ * the inode's own group with block groups)
+ */
+int ialloc_blkno(struct inode *inode, int goal) {
+	struct icache_entry *e = (struct icache_entry *)inode;
+	if(rufs_opts.prealloc <= 1 || !S_ISREG(inode->type) || e < icache || e >= icache + icache_size)
+		return get_avail_blkno_near((goal != -1) ? goal : inode_blk_goal(inode));
+
+	if(e->pa_len > 0){
+		if(goal == -1 || goal == e->pa_start){
+			take_prealloc(e->pa_start);
+			e->pa_len--;
+			return e->pa_start++;
+		}
+		// The file continues somewhere else, the window is no use
+		discard_prealloc(e);
+	}
+	if(goal == -1)
+		goal = inode_blk_goal(inode);
+	int got;
+	int blk_num = get_avail_blkno_run(goal, rufs_opts.prealloc, 1, &got);
+	if(blk_num != -1){
+		e->pa_start = blk_num + 1;
+		e->pa_len = got - 1;
+	}
+	return blk_num;
 }
 
 /* 
  * inode operations
  */
-int readi(uint16_t ino, struct inode *inode) {
+int readi(uint32_t ino, struct inode *inode) {
 
-	// Step 1: Get the inode's on-disk block number
-	int i_blk_num = (my_super_block->i_start_blk) + ino/(BLOCK_SIZE/sizeof(struct inode));
+	struct inode *cached = iget(ino);
+	if(cached == NULL)
+		return -EIO;
+	irlock(cached);
+	memcpy(inode, cached, sizeof(struct inode));
+	iunlock(cached);
+	iput(cached);
+	
+	return 0;
+}
 
-	// Step 2: Get offset of the inode in the inode on-disk block
-	int offset = (ino % (BLOCK_SIZE/sizeof(struct inode)))*sizeof(struct inode);
+int writei(uint32_t ino, struct inode *inode) {
 
-	// Step 3: Read the block from disk and then copy into inode structure
-	memset(data_blk, 0, BLOCK_SIZE);
-	bio_read(i_blk_num, data_blk);
-	memcpy(inode, ((char*)data_blk + offset), sizeof(struct inode));
+	struct inode *cached = iget(ino);
+	if(cached == NULL)
+		return -EIO;
+	if(cached != inode){
+		iwlock(cached);
+		memcpy(cached, inode, sizeof(struct inode));
+		iunlock(cached);
+	}
+	imark_dirty(cached);
+	iput(cached);
 	
 	return 0;
 }
 
-int writei(uint16_t ino, struct inode *inode) {
 
-	// Step 1: Get the block number where this inode resides on disk
-	int i_blk_num = (my_super_block->i_start_blk) + ino/(BLOCK_SIZE/sizeof(struct inode));
+/* 
+ * block mapping
+ */
 
-	// Step 2: Get offset of the inode in the inode on-disk block
-	int offset = (ino % (BLOCK_SIZE/sizeof(struct inode)))*sizeof(struct inode);
+#define PTRS_PER_BLK (BLOCK_SIZE/sizeof(int))
 
-	// Step 3: Write inode to disk 
-	memset(data_blk, 0, BLOCK_SIZE);
-	bio_read(i_blk_num, data_blk);
-	memcpy(((char*)(data_blk + offset)), inode, sizeof(struct inode));
-	bio_write(i_blk_num, data_blk);
-	
+/*
+ * Extent mapping (INODE_FL_EXTENTS)
+ *
+ * A file is described by runs of contiguous blocks instead of one pointer
+ * per block. New blocks are allocated right after the extent before them
+ * when that block is free, so a sequentially written file usually stays a
+ * single extent. The root in the inode holds EXT_ROOT_MAX extents; when it
+ * fills up they move to a leaf block and the root indexes the leaves.
+ */
+#define EXT_ROOT_MAX ((sizeof(((struct inode *)0)->i_block) - sizeof(struct ext_header))/sizeof(struct extent))
+#define EXT_IDX_ROOT_MAX ((sizeof(((struct inode *)0)->i_block) - sizeof(struct ext_header))/sizeof(struct ext_idx))
+#define EXT_LEAF_MAX ((BLOCK_SIZE - sizeof(struct ext_header))/sizeof(struct extent))
+
+#define EXT_ROOT(inode) (&(inode)->i_ext)
+#define EXT_EXTENTS(h) ((struct extent *)((struct ext_header *)(h) + 1))
+#define EXT_INDEX(h) ((struct ext_idx *)((struct ext_header *)(h) + 1))
+
+// The leaf holding the extents around a logical block
+struct ext_path {
+	struct ext_header *leaf;		/* the inode root, or buf */
+	int leaf_blk;					/* disk block of the leaf, -1 for the root */
+	int idx;						/* index entry taken in the root */
+	char buf[BLOCK_SIZE];
+};
+
+static int ext_find_leaf(struct inode *inode, int lblk, struct ext_path *path) {
+	struct ext_header *root = EXT_ROOT(inode);
+	path->leaf = root;
+	path->leaf_blk = -1;
+	path->idx = -1;
+	if(root->depth == 0)
+		return 0;
+
+	struct ext_idx *idx = EXT_INDEX(root);
+	int i = 0;
+	while(i + 1 < root->count && idx[i+1].lblk <= (uint32_t)lblk)
+		i++;
+	if(bio_read(idx[i].pblk, path->buf) < 0)
+		return -EIO;
+	path->leaf = (struct ext_header *)path->buf;
+	path->leaf_blk = idx[i].pblk;
+	path->idx = i;
+	return 0;
+}
+
+static void ext_write_leaf(struct inode *inode, struct ext_path *path) {
+	if(path->leaf_blk == -1)
+		imark_dirty(inode);
+	else
+		bio_write(path->leaf_blk, path->buf);
+}
+
+// Index of the last extent starting at or before lblk, -1 if there is none
+static int ext_search(struct ext_header *leaf, int lblk) {
+	struct extent *ext = EXT_EXTENTS(leaf);
+	int lo = 0, hi = leaf->count - 1, at = -1;
+	while(lo <= hi){
+		int mid = (lo + hi)/2;
+		if(ext[mid].lblk <= (uint32_t)lblk){
+			at = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+	return at;
+}
+
+/*
+ * Insert extent e at position pos of the leaf in path, making room by
+ * moving the root extents to a leaf block or by splitting a full leaf.
+ */
+static int ext_insert(struct inode *inode, struct ext_path *path, int pos, struct extent *e) {
+	struct ext_header *root = EXT_ROOT(inode);
+	struct ext_header *leaf = path->leaf;
+
+	if(leaf->count < leaf->max){
+		struct extent *ext = EXT_EXTENTS(leaf);
+		memmove(&ext[pos+1], &ext[pos], (leaf->count - pos)*sizeof(struct extent));
+		ext[pos] = *e;
+		leaf->count++;
+		ext_write_leaf(inode, path);
+		return 0;
+	}
+
+	if(root->depth == 0){
+		// The root is full: its extents become the first leaf block
+		int blk_num = get_avail_blkno_near(inode_blk_goal(inode));
+		if(blk_num == -1)
+			return -ENOSPC;
+		struct ext_header *new_leaf = (struct ext_header *)path->buf;
+		memset(path->buf, 0, BLOCK_SIZE);
+		new_leaf->magic = EXT_MAGIC;
+		new_leaf->count = root->count;
+		new_leaf->max = EXT_LEAF_MAX;
+		new_leaf->depth = 0;
+		memcpy(EXT_EXTENTS(new_leaf), EXT_EXTENTS(root), root->count*sizeof(struct extent));
+
+		root->depth = 1;
+		root->count = 1;
+		root->max = EXT_IDX_ROOT_MAX;
+		EXT_INDEX(root)[0].lblk = 0;
+		EXT_INDEX(root)[0].pblk = blk_num;
+		imark_dirty(inode);
+
+		path->leaf = new_leaf;
+		path->leaf_blk = blk_num;
+		path->idx = 0;
+		return ext_insert(inode, path, pos, e);
+	}
+
+	// A full leaf is split in half and the upper half is added to the root.
+	// Appending past the last leaf starts an empty one instead, so files
+	// written in order keep their leaves full.
+	if(root->count >= root->max)
+		return -EFBIG;
+	int blk_num = get_avail_blkno_near(inode_blk_goal(inode));
+	if(blk_num == -1)
+		return -ENOSPC;
+	char buf[BLOCK_SIZE];
+	struct ext_header *sibling = (struct ext_header *)buf;
+	int half = (pos == leaf->count && path->idx == root->count - 1) ? leaf->count : leaf->count/2;
+	memset(buf, 0, BLOCK_SIZE);
+	sibling->magic = EXT_MAGIC;
+	sibling->count = leaf->count - half;
+	sibling->max = EXT_LEAF_MAX;
+	sibling->depth = 0;
+	memcpy(EXT_EXTENTS(sibling), &EXT_EXTENTS(leaf)[half], sibling->count*sizeof(struct extent));
+	leaf->count = half;
+
+	struct ext_idx *idx = EXT_INDEX(root);
+	int at = path->idx + 1;
+	memmove(&idx[at+1], &idx[at], (root->count - at)*sizeof(struct ext_idx));
+	idx[at].lblk = (sibling->count > 0) ? EXT_EXTENTS(sibling)[0].lblk : e->lblk;
+	idx[at].pblk = blk_num;
+	root->count++;
+	imark_dirty(inode);
+
+	if(pos > half || sibling->count == 0){
+		bio_write(path->leaf_blk, path->buf);
+		memcpy(path->buf, buf, BLOCK_SIZE);
+		path->leaf_blk = blk_num;
+		path->idx = at;
+		pos -= half;
+	}
+	else
+		bio_write(blk_num, buf);
+	return ext_insert(inode, path, pos, e);
+}
+
+/*
+ * Extent version of get_blkno(). When run is not NULL it is set to the
+ * number of blocks from lblk on that are contiguous on disk.
+ */
+static int ext_get_blkno(struct inode *inode, int lblk, int alloc, int *run) {
+	struct ext_path path;
+	if(ext_find_leaf(inode, lblk, &path) < 0)
+		return -1;
+	struct extent *ext = EXT_EXTENTS(path.leaf);
+	int i = ext_search(path.leaf, lblk);
+	if(i >= 0 && (uint32_t)lblk < ext[i].lblk + ext[i].len){
+		if(run != NULL)
+			*run = ext[i].lblk + ext[i].len - lblk;
+		return ext[i].pblk + (lblk - ext[i].lblk);
+	}
+	if(!alloc)
+		return -1;
+
+	// Aim for the block that would continue the extent before lblk
+	int goal = (i >= 0) ? (int)(ext[i].pblk + (lblk - ext[i].lblk)) : -1;
+	int blk_num = ialloc_blkno(inode, goal);
+	if(blk_num == -1)
+		return -1;
+	if(run != NULL)
+		*run = 1;
+
+	// Extend the extent before or after lblk when the new block touches it
+	if(i >= 0 && ext[i].lblk + ext[i].len == (uint32_t)lblk && ext[i].pblk + ext[i].len == (uint32_t)blk_num){
+		ext[i].len++;
+		if(i + 1 < path.leaf->count && ext[i+1].lblk == (uint32_t)lblk + 1 && ext[i+1].pblk == (uint32_t)blk_num + 1){
+			ext[i].len += ext[i+1].len;
+			memmove(&ext[i+1], &ext[i+2], (path.leaf->count - i - 2)*sizeof(struct extent));
+			path.leaf->count--;
+		}
+		ext_write_leaf(inode, &path);
+		return blk_num;
+	}
+	if(i + 1 < path.leaf->count && ext[i+1].lblk == (uint32_t)lblk + 1 && ext[i+1].pblk == (uint32_t)blk_num + 1){
+		ext[i+1].lblk--;
+		ext[i+1].pblk--;
+		ext[i+1].len++;
+		ext_write_leaf(inode, &path);
+		return blk_num;
+	}
+
+	struct extent e = { lblk, 1, blk_num };
+	if(ext_insert(inode, &path, i + 1, &e) < 0){
+		release_blkno(blk_num);
+		return -1;
+	}
+	return blk_num;
+}
+
+// Extent version of put_blkno()
+static void ext_put_blkno(struct inode *inode, int lblk) {
+	struct ext_path path;
+	if(ext_find_leaf(inode, lblk, &path) < 0)
+		return;
+	struct ext_header *leaf = path.leaf;
+	struct extent *ext = EXT_EXTENTS(leaf);
+	int i = ext_search(leaf, lblk);
+	if(i < 0 || (uint32_t)lblk >= ext[i].lblk + ext[i].len)
+		return;
+
+	int off = lblk - ext[i].lblk;
+	if(off > 0 && off < (int)ext[i].len - 1){
+		// Punching the middle of an extent leaves two
+		int blk_num = ext[i].pblk + off;
+		struct extent tail = { lblk + 1, ext[i].len - off - 1, blk_num + 1 };
+		ext[i].len = off;
+		if(ext_insert(inode, &path, i + 1, &tail) < 0){
+			ext[i].len += tail.len + 1;
+			return;
+		}
+		release_blkno(blk_num);
+		return;
+	}
+
+	release_blkno(ext[i].pblk + off);
+	if(off == 0){
+		ext[i].lblk++;
+		ext[i].pblk++;
+	}
+	if(--ext[i].len > 0){
+		ext_write_leaf(inode, &path);
+		return;
+	}
+
+	memmove(&ext[i], &ext[i+1], (leaf->count - i - 1)*sizeof(struct extent));
+	leaf->count--;
+	if(leaf->count > 0 || path.leaf_blk == -1){
+		ext_write_leaf(inode, &path);
+		return;
+	}
+
+	// The leaf block is empty, drop it from the root
+	struct ext_header *root = EXT_ROOT(inode);
+	struct ext_idx *idx = EXT_INDEX(root);
+	release_blkno(path.leaf_blk);
+	memmove(&idx[path.idx], &idx[path.idx+1], (root->count - path.idx - 1)*sizeof(struct ext_idx));
+	root->count--;
+	if(root->count == 0){
+		root->depth = 0;
+		root->max = EXT_ROOT_MAX;
+	}
+	else
+		idx[0].lblk = 0;
+	imark_dirty(inode);
+}
+
+// Append blocks blk .. blk+count-1 to runs, growing the last run when they continue it
+static int add_run(struct bio_run *runs, int *n, int max, int blk, int count) {
+	if(*n > 0 && runs[*n-1].start + runs[*n-1].len == blk){
+		runs[*n-1].len += count;
+		return 0;
+	}
+	if(*n >= max)
+		return -1;
+	runs[*n].start = blk;
+	runs[*n].len = count;
+	(*n)++;
+	return 0;
+}
+
+/*
+ * Truncation collects the blocks it frees in runs and gives each run back
+ * with one release_blkno_run(), FREE_RUNS runs at a time
+ */
+#define FREE_RUNS 64
+
+static void free_runs(struct bio_run *runs, int *n) {
+	for(int i=0; i<*n; i++)
+		release_blkno_run(runs[i].start, runs[i].len);
+	*n = 0;
+}
+
+static void free_later(struct bio_run *runs, int *n, int blk, int count) {
+	if(add_run(runs, n, FREE_RUNS, blk, count) == 0)
+		return;
+	free_runs(runs, n);
+	add_run(runs, n, FREE_RUNS, blk, count);
+}
+
+// Cut the extents of a node at logical block from, returns 1 if any changed
+static int ext_trim(struct ext_header *h, int from, struct bio_run *runs, int *n) {
+	struct extent *ext = EXT_EXTENTS(h);
+	int changed = 0;
+	for(int i = h->count - 1; i >= 0 && ext[i].lblk + ext[i].len > (uint32_t)from; i--){
+		int keep = (ext[i].lblk < (uint32_t)from) ? from - ext[i].lblk : 0;
+		free_later(runs, n, ext[i].pblk + keep, ext[i].len - keep);
+		ext[i].len = keep;
+		if(keep == 0)
+			h->count = i;
+		changed = 1;
+	}
+	return changed;
+}
+
+/*
+ * Extent version of blkmap_truncate(). Leaves that end before from are
+ * not read; leaves left empty are freed and dropped from the root.
+ */
+static void ext_truncate(struct inode *inode, int from, struct bio_run *runs, int *n) {
+	struct ext_header *root = EXT_ROOT(inode);
+	struct ext_idx *idx = EXT_INDEX(root);
+	char buf[BLOCK_SIZE];
+	int kept = 0;
+
+	if(root->depth == 0){
+		ext_trim(root, from, runs, n);
+		return;
+	}
+	for(int l=0; l<root->count; l++){
+		if((l + 1 < root->count && idx[l+1].lblk <= (uint32_t)from) || bio_read(idx[l].pblk, buf) < 0){
+			idx[kept++] = idx[l];
+			continue;
+		}
+		struct ext_header *leaf = (struct ext_header *)buf;
+		if(ext_trim(leaf, from, runs, n) && leaf->count > 0)
+			bio_write(idx[l].pblk, buf);
+		if(leaf->count > 0)
+			idx[kept++] = idx[l];
+		else
+			free_later(runs, n, idx[l].pblk, 1);
+	}
+	root->count = kept;
+	if(kept == 0){
+		root->depth = 0;
+		root->max = EXT_ROOT_MAX;
+	}
+}
+
+/*
+ * Pointer version of blkmap_truncate(). An indirect block whose range
+ * starts at or after from is freed with everything it points to.
+ */
+static void ptr_truncate(struct inode *inode, int from, struct bio_run *runs, int *n) {
+	int ptrs[PTRS_PER_BLK];
+
+	for(int i = (from < 16) ? from : 16; i<16; i++){
+		if(inode->direct_ptr[i] != -1)
+			free_later(runs, n, inode->direct_ptr[i], 1);
+		inode->direct_ptr[i] = -1;
+	}
+	for(int k=0; k<8; k++){
+		int first = 16 + k*PTRS_PER_BLK;
+		if(inode->indirect_ptr[k] == -1 || first + (int)PTRS_PER_BLK <= from)
+			continue;
+		if(bio_read(inode->indirect_ptr[k], ptrs) < 0)
+			continue;
+		int start = (from > first) ? from - first : 0;
+		int changed = 0;
+		for(int j=start; j<PTRS_PER_BLK; j++){
+			if(ptrs[j] == -1)
+				continue;
+			free_later(runs, n, ptrs[j], 1);
+			ptrs[j] = -1;
+			changed = 1;
+		}
+		if(start == 0){
+			free_later(runs, n, inode->indirect_ptr[k], 1);
+			inode->indirect_ptr[k] = -1;
+		}
+		else if(changed)
+			bio_write(inode->indirect_ptr[k], ptrs);
+	}
+}
+
+/*
+ * Free the data and mapping blocks of a file from logical block from on,
+ * whole extents, leaves and indirect blocks at a time, and the
+ * preallocation window. The inode must come from iget() and be write
+ * locked.
+ */
+void blkmap_truncate(struct inode *inode, int from) {
+	struct bio_run runs[FREE_RUNS];
+	int n = 0;
+
+	idiscard_prealloc(inode);
+	if(inode->flags & INODE_FL_INLINE)
+		return;
+	if(inode->flags & INODE_FL_EXTENTS)
+		ext_truncate(inode, from, runs, &n);
+	else
+		ptr_truncate(inode, from, runs, &n);
+	free_runs(runs, &n);
+	imark_dirty(inode);
+}
+
+// Set up an empty block map, with extents when the file system was made with them
+static void blkmap_setup(struct inode *inode) {
+	if(my_super_block->features & SB_FEAT_EXTENTS){
+		memset(inode->i_block, 0, sizeof(inode->i_block));
+		EXT_ROOT(inode)->magic = EXT_MAGIC;
+		EXT_ROOT(inode)->max = EXT_ROOT_MAX;
+		inode->flags |= INODE_FL_EXTENTS;
+		return;
+	}
+	for(int i=0; i<16; i++)
+		inode->direct_ptr[i] = -1;
+	for(int i=0; i<8; i++)
+		inode->indirect_ptr[i] = -1;
+}
+
+/*
+ * Set up the block map of a new inode. With SB_FEAT_INLINE_DATA it starts
+ * out inline, except for directories of fixed size dirents which are too
+ * big for the inode.
+ */
+void init_blkmap(struct inode *inode) {
+	if((my_super_block->features & SB_FEAT_INLINE_DATA) &&
+	   (!S_ISDIR(inode->type) || (my_super_block->features & SB_FEAT_VAR_DIRENT))){
+		memset(inode->i_block, 0, sizeof(inode->i_block));
+		inode->flags |= INODE_FL_INLINE;
+		return;
+	}
+	blkmap_setup(inode);
+}
+
+/*
+ * Free all data and mapping blocks of a file. The inode must come from
+ * iget().
+ */
+void free_blkmap(struct inode *inode) {
+	blkmap_truncate(inode, 0);
+}
+
+/*
+ * Map logical block lblk of a file to its disk block. Missing data and
+ * indirect blocks are allocated when alloc is set. Returns -1 for a hole.
+ * The inode must come from iget().
+ */
+int get_blkno(struct inode *inode, int lblk, int alloc) {
+	if(lblk < 0 || (inode->flags & INODE_FL_INLINE))
+		return -1;
+	if(inode->flags & INODE_FL_EXTENTS)
+		return ext_get_blkno(inode, lblk, alloc, NULL);
+	if(lblk < 16){
+		if(inode->direct_ptr[lblk] == -1 && alloc){
+			// Aim for the block after the previous one of the file
+			int goal = (lblk > 0 && inode->direct_ptr[lblk-1] != -1) ? inode->direct_ptr[lblk-1] + 1 : -1;
+			int blk_num = ialloc_blkno(inode, goal);
+			if(blk_num == -1)
+				return -1;
+			inode->direct_ptr[lblk] = blk_num;
+			imark_dirty(inode);
+		}
+		return inode->direct_ptr[lblk];
+	}
+
+	int ind_blk_num = (lblk-16) / PTRS_PER_BLK;
+	int ind_blk_offset = (lblk-16) % PTRS_PER_BLK;
+	if(ind_blk_num >= 8)
+		return -1;
+
+	int ptr_blk_num = inode->indirect_ptr[ind_blk_num];
+	if(ptr_blk_num == -1){
+		if(!alloc)
+			return -1;
+		ptr_blk_num = ialloc_blkno(inode, -1);
+		if(ptr_blk_num == -1)
+			return -1;
+		int ptrs[PTRS_PER_BLK];
+		memset(ptrs, -1, BLOCK_SIZE);
+		bio_write(ptr_blk_num, ptrs);
+		inode->indirect_ptr[ind_blk_num] = ptr_blk_num;
+		imark_dirty(inode);
+	}
+
+	// Look at the pointer block in place, it only changes when allocating
+	int *ptrs = bio_get(ptr_blk_num);
+	if(ptrs == NULL)
+		return -1;
+	int blk_num = ptrs[ind_blk_offset];
+	int dirty = 0;
+	if(blk_num == -1 && alloc){
+		int goal = (ind_blk_offset > 0 && ptrs[ind_blk_offset-1] != -1) ? ptrs[ind_blk_offset-1] + 1 : ptr_blk_num + 1;
+		blk_num = ialloc_blkno(inode, goal);
+		if(blk_num != -1){
+			ptrs[ind_blk_offset] = blk_num;
+			dirty = 1;
+		}
+	}
+	bio_put(ptr_blk_num, ptrs, dirty);
+	return blk_num;
+}
+
+/*
+ * Free logical block lblk of a file, and its indirect block once that no
+ * longer maps anything. The inode must come from iget().
+ */
+void put_blkno(struct inode *inode, int lblk) {
+	if(lblk < 0 || (inode->flags & INODE_FL_INLINE))
+		return;
+	if(inode->flags & INODE_FL_EXTENTS){
+		ext_put_blkno(inode, lblk);
+		return;
+	}
+	if(lblk < 16){
+		if(inode->direct_ptr[lblk] != -1){
+			release_blkno(inode->direct_ptr[lblk]);
+			inode->direct_ptr[lblk] = -1;
+			imark_dirty(inode);
+		}
+		return;
+	}
+
+	int ind_blk_num = (lblk-16) / PTRS_PER_BLK;
+	int ind_blk_offset = (lblk-16) % PTRS_PER_BLK;
+	if(ind_blk_num >= 8 || inode->indirect_ptr[ind_blk_num] == -1)
+		return;
+
+	int ptrs[PTRS_PER_BLK];
+	if(bio_read(inode->indirect_ptr[ind_blk_num], ptrs) < 0 || ptrs[ind_blk_offset] == -1)
+		return;
+	release_blkno(ptrs[ind_blk_offset]);
+	ptrs[ind_blk_offset] = -1;
+
+	int in_use = 0;
+	for(int i=0; i<PTRS_PER_BLK && !in_use; i++)
+		in_use = (ptrs[i] != -1);
+	if(in_use){
+		bio_write(inode->indirect_ptr[ind_blk_num], ptrs);
+	}
+	else{
+		release_blkno(inode->indirect_ptr[ind_blk_num]);
+		inode->indirect_ptr[ind_blk_num] = -1;
+		imark_dirty(inode);
+	}
+}
+
+
+/*
+ * Like get_blkno() without allocation, but also report in *run how many
+ * blocks from lblk on, up to max, are contiguous on disk so callers can
+ * transfer them together. Holes report a run of 1.
+ */
+int get_blkno_run(struct inode *inode, int lblk, int max, int *run) {
+	*run = 1;
+	if(lblk >= 0 && (inode->flags & INODE_FL_EXTENTS)){
+		int blk_num = ext_get_blkno(inode, lblk, 0, run);
+		if(*run > max)
+			*run = max;
+		return blk_num;
+	}
+
+	int blk_num = get_blkno(inode, lblk, 0);
+	while(blk_num != -1 && *run < max && get_blkno(inode, lblk + *run, 0) == blk_num + *run)
+		(*run)++;
+	return blk_num;
+}
+
+/*
+ * Append the disk blocks of a file, data and mapping blocks, to runs as
+ * runs of contiguous blocks. Returns -1 when they need more than max runs.
+ * The inode must come from iget() and be locked.
+ */
+int blkmap_runs(struct inode *inode, struct bio_run *runs, int *n, int max) {
+	char buf[BLOCK_SIZE];
+
+	if(inode->flags & INODE_FL_INLINE)
+		return 0;
+	if(inode->flags & INODE_FL_EXTENTS){
+		struct ext_header *root = EXT_ROOT(inode);
+		int nleaves = (root->depth == 0) ? 1 : root->count;
+		for(int l=0; l<nleaves; l++){
+			struct ext_header *leaf = root;
+			if(root->depth > 0){
+				int leaf_blk = EXT_INDEX(root)[l].pblk;
+				if(add_run(runs, n, max, leaf_blk, 1) < 0 || bio_read(leaf_blk, buf) < 0)
+					return -1;
+				leaf = (struct ext_header *)buf;
+			}
+			struct extent *ext = EXT_EXTENTS(leaf);
+			for(int i=0; i<leaf->count; i++){
+				if(add_run(runs, n, max, ext[i].pblk, ext[i].len) < 0)
+					return -1;
+			}
+		}
+		return 0;
+	}
+	for(int i=0; i<16; i++){
+		if(inode->direct_ptr[i] != -1 && add_run(runs, n, max, inode->direct_ptr[i], 1) < 0)
+			return -1;
+	}
+	for(int i=0; i<8; i++){
+		if(inode->indirect_ptr[i] == -1)
+			continue;
+		int *ptrs = (int *)buf;
+		if(add_run(runs, n, max, inode->indirect_ptr[i], 1) < 0 || bio_read(inode->indirect_ptr[i], ptrs) < 0)
+			return -1;
+		for(int k=0; k<PTRS_PER_BLK; k++){
+			if(ptrs[k] != -1 && add_run(runs, n, max, ptrs[k], 1) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Inline data (INODE_FL_INLINE). The first INLINE_MAX bytes of a small
+ * file or directory live in i_block in place of the block map, so they
+ * cost no data block and are read along with the inode. The write that
+ * outgrows them moves them to block 0 with inline_expand().
+ */
+#define INLINE_MAX ((int)sizeof(((struct inode *)0)->i_block))
+
+/*
+ * Give an inline inode a block map, with blk as the contents of block 0.
+ * Without blk the inline bytes are moved, and an empty file gets no block.
+ * Returns -ENOSPC and leaves the inode inline if no block is free.
+ */
+int inline_expand(struct inode *inode, const void *blk) {
+	char buf[BLOCK_SIZE];
+	uint32_t saved[INLINE_MAX/sizeof(uint32_t)];
+
+	if(blk == NULL){
+		memset(buf, 0, BLOCK_SIZE);
+		memcpy(buf, inode->i_block, INLINE_MAX);
+		blk = (inode->size > 0) ? buf : NULL;
+	}
+	memcpy(saved, inode->i_block, INLINE_MAX);
+	inode->flags &= ~INODE_FL_INLINE;
+	blkmap_setup(inode);
+	imark_dirty(inode);
+	if(blk == NULL)
+		return 0;
+
+	int blk_num = get_blkno(inode, 0, 1);
+	if(blk_num == -1){
+		inode->flags = (inode->flags & ~INODE_FL_EXTENTS) | INODE_FL_INLINE;
+		memcpy(inode->i_block, saved, INLINE_MAX);
+		return -ENOSPC;
+	}
+	bio_write(blk_num, blk);
+	return 0;
+}
+
+
+/* 
+ * Dentry cache
+ *
+ * Maps (parent directory inode, name) to the inode number found there, or
+ * records that the name does not exist (a negative entry, ino == -1), so
+ * repeated path walks do not rescan directory blocks. Entries are replaced
+ * in LRU order. Names longer than DCACHE_NAME_LEN are not cached.
+ * dcache_lock protects all of it.
+ */
+#define DCACHE_NAME_LEN 64
+
+struct dcache_entry {
+	int parent;							/* directory inode, -1 if unused */
+	int ino;							/* inode of the name, -1 if negative */
+	size_t len;							/* length of name */
+	char name[DCACHE_NAME_LEN];			/* name, not NUL terminated */
+	struct dcache_entry *hnext;			/* hash chain */
+	struct dcache_entry *prev, *next;	/* LRU list, head is most recent */
+};
+
+static struct dcache_entry *dcache;
+static struct dcache_entry **dcache_hash;
+static struct dcache_entry *dlru_head, *dlru_tail;
+static int dcache_size;
+static int dcache_buckets;
+static unsigned long dcache_hits;
+static unsigned long dcache_misses;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int dcache_init(int nr_entries) {
+	if(nr_entries <= 0)
+		return 0;
+	dcache_buckets = 1;
+	while(dcache_buckets < nr_entries)
+		dcache_buckets <<= 1;
+	dcache = calloc(nr_entries, sizeof(struct dcache_entry));
+	dcache_hash = calloc(dcache_buckets, sizeof(struct dcache_entry *));
+	if(dcache == NULL || dcache_hash == NULL){
+		perror("dcache_init failed");
+		free(dcache);
+		free(dcache_hash);
+		dcache = NULL;
+		dcache_hash = NULL;
+		return -1;
+	}
+	for(int i=0; i<nr_entries; i++){
+		dcache[i].parent = -1;
+		dcache[i].prev = (i > 0) ? &dcache[i-1] : NULL;
+		dcache[i].next = (i < nr_entries-1) ? &dcache[i+1] : NULL;
+	}
+	dlru_head = &dcache[0];
+	dlru_tail = &dcache[nr_entries-1];
+	dcache_size = nr_entries;
+	dcache_hits = 0;
+	dcache_misses = 0;
+	return 0;
+}
+
+static void dcache_free() {
+	free(dcache);
+	free(dcache_hash);
+	dcache = NULL;
+	dcache_hash = NULL;
+	dcache_size = 0;
+}
+
+// FNV-1a over the parent inode number and the name
+static unsigned int dcache_hashfn(int parent, const char *name, size_t len) {
+	unsigned int h = 2166136261u ^ (unsigned int)parent;
+	for(size_t i=0; i<len; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h & (dcache_buckets-1);
+}
+
+static struct dcache_entry **dcache_slot(int parent, const char *name, size_t len) {
+	struct dcache_entry **pp = &dcache_hash[dcache_hashfn(parent, name, len)];
+	while(*pp != NULL && ((*pp)->parent != parent || (*pp)->len != len || memcmp((*pp)->name, name, len) != 0))
+		pp = &(*pp)->hnext;
+	return pp;
+}
+
+static void dcache_touch(struct dcache_entry *e) {
+	if(dlru_head == e)
+		return;
+	e->prev->next = e->next;
+	if(e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		dlru_tail = e->prev;
+	e->prev = NULL;
+	e->next = dlru_head;
+	dlru_head->prev = e;
+	dlru_head = e;
+}
+
+static void dcache_unhash(struct dcache_entry *e) {
+	struct dcache_entry **pp = dcache_slot(e->parent, e->name, e->len);
+	*pp = e->hnext;
+	e->hnext = NULL;
+	e->parent = -1;
+}
+
+/*
+ * Look up name in directory parent. Returns 1 and sets *ino on a positive
+ * hit, 0 on a negative hit, and -1 if the name is not cached.
+ */
+int dcache_lookup(int parent, const char *name, size_t len, int *ino) {
+	if(dcache_size == 0 || len > DCACHE_NAME_LEN)
+		return -1;
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *e = *dcache_slot(parent, name, len);
+	int ret = -1;
+	if(e == NULL){
+		dcache_misses++;
+	}
+	else{
+		dcache_hits++;
+		dcache_touch(e);
+		*ino = e->ino;
+		ret = (e->ino >= 0) ? 1 : 0;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return ret;
+}
+
+/*
+ * Record that name in directory parent refers to ino, or to nothing if ino is -1
+ */
+void dcache_insert(int parent, const char *name, size_t len, int ino) {
+	if(dcache_size == 0 || len > DCACHE_NAME_LEN)
+		return;
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry **pp = dcache_slot(parent, name, len);
+	struct dcache_entry *e = *pp;
+	if(e == NULL){
+		e = dlru_tail;
+		if(e->parent >= 0)
+			dcache_unhash(e);
+		e->parent = parent;
+		e->len = len;
+		memcpy(e->name, name, len);
+		pp = dcache_slot(parent, name, len);
+		e->hnext = *pp;
+		*pp = e;
+	}
+	e->ino = ino;
+	dcache_touch(e);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * Forget every entry looked up inside directory parent, used when it is removed
+ */
+void dcache_prune_dir(int parent) {
+	pthread_mutex_lock(&dcache_lock);
+	for(int i=0; i<dcache_size; i++){
+		if(dcache[i].parent == parent)
+			dcache_unhash(&dcache[i]);
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* 
+ * directory operations
+ */
+#define DIRENTS_PER_BLK (BLOCK_SIZE/sizeof(struct fdirent))
+#define DX_ENTRIES_PER_BLK ((BLOCK_SIZE - sizeof(struct dx_header))/sizeof(struct dx_entry))
+#define DX_MAX_LEVELS 2
+
+#define VAR_DIRENTS (my_super_block->features & SB_FEAT_VAR_DIRENT)
+
+typedef int (*dir_iter_fn)(void *arg, const struct dirent *dirent);
+
+static int dx_read(struct inode *dir_inode, int lblk, void *buf) {
+	int blk_num = get_blkno(dir_inode, lblk, 0);
+	if(blk_num == -1 || bio_read(blk_num, buf) < 0)
+		return -EIO;
+	return 0;
+}
+
+static int dx_write(struct inode *dir_inode, int lblk, const void *buf) {
+	int blk_num = get_blkno(dir_inode, lblk, 0);
+	if(blk_num == -1 || bio_write(blk_num, buf) < 0)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Directory block formats. With fixed dirents a block is an array of struct
+ * fdirent slots where valid marks a used slot; with SB_FEAT_VAR_DIRENT it is
+ * a chain of vdirent records. These helpers hide the difference from the
+ * directory code above them.
+ */
+#define VDIRENTS_MAX_PER_BLK (BLOCK_SIZE/VDIRENT_LEN(1))
+
+// On-disk size of an entry, directory sizes are the sum over their entries
+static int dirent_size(size_t name_len) {
+	return VAR_DIRENTS ? VDIRENT_LEN(name_len) : sizeof(struct fdirent);
+}
+
+/*
+ * Fixed dirents are converted to and from struct dirent at the block
+ * boundary, their 16-bit inode number is why mkfs caps the inode count
+ * of a fixed_dirents image at 65536.
+ */
+static void fdirent_load(struct dirent *dirent, const struct fdirent *fde) {
+	memset(dirent, 0, sizeof(struct dirent));
+	dirent->ino = fde->ino;
+	dirent->valid = fde->valid;
+	dirent->len = fde->len;
+	memcpy(dirent->name, fde->name, sizeof(fde->name));
+}
+
+static void fdirent_store(struct fdirent *fde, const struct dirent *dirent) {
+	fde->ino = dirent->ino;
+	fde->valid = dirent->valid;
+	fde->len = dirent->len;
+	memcpy(fde->name, dirent->name, sizeof(fde->name));
+}
+
+static struct vdirent *vdirent_next(void *blk, struct vdirent *de) {
+	int off = (char *)de - (char *)blk + de->rec_len;
+	if(de->rec_len < sizeof(struct vdirent) || off >= BLOCK_SIZE)
+		return NULL;
+	return (struct vdirent *)((char *)blk + off);
+}
+
+static void dblk_init(void *blk) {
+	memset(blk, 0, BLOCK_SIZE);
+	if(VAR_DIRENTS)
+		((struct vdirent *)blk)->rec_len = BLOCK_SIZE;
+}
+
+static int dblk_find(void *blk, const char *fname, size_t name_len, struct dirent *dirent) {
+	if(VAR_DIRENTS){
+		for(struct vdirent *de = blk; de != NULL; de = vdirent_next(blk, de)){
+			if(de->name_len == name_len && memcmp(de->name, fname, name_len) == 0){
+				if(dirent != NULL){
+					memset(dirent, 0, sizeof(struct dirent));
+					dirent->ino = de->ino;
+					dirent->valid = 1;
+					dirent->len = name_len;
+					memcpy(dirent->name, fname, name_len);
+				}
+				return 0;
+			}
+		}
+		return -1;
+	}
+	struct fdirent *dirents = blk;
+	for(int i=0; i<DIRENTS_PER_BLK; i++){
+		if(dirents[i].valid && dirents[i].len == (int)name_len && strncmp(dirents[i].name, fname, name_len) == 0){
+			if(dirent != NULL)
+				fdirent_load(dirent, &dirents[i]);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int dblk_insert(void *blk, const struct dirent *entry) {
+	if(VAR_DIRENTS){
+		int need = VDIRENT_LEN(entry->len);
+		for(struct vdirent *de = blk; de != NULL; de = vdirent_next(blk, de)){
+			int used = de->name_len ? VDIRENT_LEN(de->name_len) : 0;
+			if(de->rec_len - used < need)
+				continue;
+			// Carve the new record out of the slack at the end of this one
+			if(used > 0){
+				struct vdirent *new_de = (struct vdirent *)((char *)de + used);
+				new_de->rec_len = de->rec_len - used;
+				de->rec_len = used;
+				de = new_de;
+			}
+			de->ino = entry->ino;
+			de->name_len = entry->len;
+			de->reserved = 0;
+			memcpy(de->name, entry->name, entry->len);
+			return 0;
+		}
+		return -ENOSPC;
+	}
+	struct fdirent *dirents = blk;
+	for(int i=0; i<DIRENTS_PER_BLK; i++){
+		if(!dirents[i].valid){
+			fdirent_store(&dirents[i], entry);
+			return 0;
+		}
+	}
+	return -ENOSPC;
+}
+
+static int dblk_remove(void *blk, const char *fname, size_t name_len) {
+	if(VAR_DIRENTS){
+		struct vdirent *prev = NULL;
+		for(struct vdirent *de = blk; de != NULL; prev = de, de = vdirent_next(blk, de)){
+			if(de->name_len != name_len || memcmp(de->name, fname, name_len) != 0)
+				continue;
+			// Merge the record into the one before it, the first one just goes unused
+			if(prev != NULL)
+				prev->rec_len += de->rec_len;
+			else
+				de->name_len = 0;
+			return 0;
+		}
+		return -ENOENT;
+	}
+	struct fdirent *dirents = blk;
+	for(int i=0; i<DIRENTS_PER_BLK; i++){
+		if(dirents[i].valid && dirents[i].len == (int)name_len && strncmp(dirents[i].name, fname, name_len) == 0){
+			memset(&dirents[i], 0, sizeof(struct fdirent));
+			return 0;
+		}
+	}
+	return -ENOENT;
+}
+
+static int dblk_iterate(void *blk, dir_iter_fn fn, void *arg) {
+	if(VAR_DIRENTS){
+		struct dirent dirent;
+		for(struct vdirent *de = blk; de != NULL; de = vdirent_next(blk, de)){
+			if(de->name_len == 0)
+				continue;
+			memset(&dirent, 0, sizeof(struct dirent));
+			dirent.ino = de->ino;
+			dirent.valid = 1;
+			dirent.len = de->name_len;
+			memcpy(dirent.name, de->name, de->name_len);
+			int ret = fn(arg, &dirent);
+			if(ret != 0)
+				return ret;
+		}
+		return 0;
+	}
+	struct fdirent *dirents = blk;
+	struct dirent dirent;
+	for(int i=0; i<DIRENTS_PER_BLK; i++){
+		if(!dirents[i].valid)
+			continue;
+		fdirent_load(&dirent, &dirents[i]);
+		int ret = fn(arg, &dirent);
+		if(ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int dblk_is_empty(void *blk) {
+	if(VAR_DIRENTS)
+		return ((struct vdirent *)blk)->name_len == 0 && ((struct vdirent *)blk)->rec_len == BLOCK_SIZE;
+	struct fdirent *dirents = blk;
+	for(int i=0; i<DIRENTS_PER_BLK; i++){
+		if(dirents[i].valid)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * An inline directory is a chain of vdirent records over i_block. It is
+ * worked on as a directory block whose last record takes in the rest of
+ * the block, and put back if its records still end within INLINE_MAX.
+ */
+static void inline_dblk_load(struct inode *dir_inode, void *blk) {
+	dblk_init(blk);
+	if(dir_inode->size == 0)
+		return;
+	memcpy(blk, dir_inode->i_block, INLINE_MAX);
+	struct vdirent *de = blk, *next;
+	while((next = vdirent_next(blk, de)) != NULL && (char *)next - (char *)blk < INLINE_MAX)
+		de = next;
+	de->rec_len += BLOCK_SIZE - INLINE_MAX;
+}
+
+static int inline_dblk_store(struct inode *dir_inode, void *blk) {
+	struct vdirent *de = blk, *next;
+	while((next = vdirent_next(blk, de)) != NULL)
+		de = next;
+	int off = (char *)de - (char *)blk;
+	if(off + (de->name_len ? VDIRENT_LEN(de->name_len) : 0) > INLINE_MAX)
+		return -1;
+	de->rec_len = INLINE_MAX - off;
+	memcpy(dir_inode->i_block, blk, INLINE_MAX);
+	imark_dirty(dir_inode);
+	return 0;
+}
+
+/*
+ * Linear directories keep their dirents packed in order, so the entry count
+ * is size/sizeof(struct fdirent) and removal moves the last entry into the hole.
+ * With variable dirents a linear directory is only ever block 0, it is
+ * indexed as soon as that block is full.
+ */
+static int linear_find(struct inode *dir_inode, const char *fname, size_t name_len, struct dirent *dirent) {
+	if(VAR_DIRENTS){
+		if(dir_inode->size == 0)
+			return -1;
+		if(dir_inode->flags & INODE_FL_INLINE){
+			char buf[BLOCK_SIZE];
+			inline_dblk_load(dir_inode, buf);
+			return dblk_find(buf, fname, name_len, dirent);
+		}
+		int blk_num = get_blkno(dir_inode, 0, 0);
+		void *blk = (blk_num == -1) ? NULL : bio_get(blk_num);
+		if(blk == NULL)
+			return -EIO;
+		int ret = dblk_find(blk, fname, name_len, dirent);
+		bio_put(blk_num, blk, 0);
+		return ret;
+	}
+
+	int num_dirents = dir_inode->size/sizeof(struct fdirent);
+	if(debugInner)
+		printf("\n     -> Num Dirents in parent_dir is %d", num_dirents);
+
+	// Blocks are scanned in place instead of being copied out
+	for(int k=0; k<num_dirents; k+=DIRENTS_PER_BLK){
+		int d_blk_num = get_blkno(dir_inode, k/DIRENTS_PER_BLK, 0);
+		int num_dirents_blk = (num_dirents - k > DIRENTS_PER_BLK) ? DIRENTS_PER_BLK : num_dirents - k;
+		if(debugInner)
+			printf("\n     -> Num Dirents in block # %d is %d", d_blk_num, num_dirents_blk);
+		struct fdirent *dirents = (d_blk_num == -1) ? NULL : bio_get(d_blk_num);
+		if(dirents == NULL)
+			return -EIO;
+		for(int i=0; i<num_dirents_blk; i++){
+			if(dirents[i].len == (int)name_len && strncmp(dirents[i].name, fname, name_len) == 0)
+			{
+				fdirent_load(dirent, &dirents[i]);
+				bio_put(d_blk_num, dirents, 0);
+				return 0;
+			}
+		}
+		bio_put(d_blk_num, dirents, 0);
+	}
+	return -1;
+}
+
+// Returns 1 if the first block is full and the directory should be indexed
+static int linear_add(struct inode *dir_inode, const struct dirent *entry) {
+	if(VAR_DIRENTS && (dir_inode->flags & INODE_FL_INLINE)){
+		inline_dblk_load(dir_inode, data_blk);
+		dblk_insert(data_blk, entry);
+		if(inline_dblk_store(dir_inode, data_blk) == 0)
+			return 0;
+		return inline_expand(dir_inode, data_blk);
+	}
+	if(VAR_DIRENTS){
+		int blk_num = get_blkno(dir_inode, 0, 1);
+		if(blk_num == -1)
+			return -ENOSPC;
+		if(dir_inode->size == 0)
+			dblk_init(data_blk);
+		else
+			bio_read(blk_num, data_blk);
+		if(dblk_insert(data_blk, entry) < 0)
+			return 1;
+		bio_write(blk_num, data_blk);
+		return 0;
+	}
+
+	// The new entry goes right after the last one, in a new block if that one is full
+	int num_dirents = dir_inode->size/sizeof(struct fdirent);
+	if(num_dirents == DIRENTS_PER_BLK)
+		return 1;
+	int offset = (num_dirents % DIRENTS_PER_BLK)*sizeof(struct fdirent);
+	int final_blk_num = get_blkno(dir_inode, num_dirents/DIRENTS_PER_BLK, 1);
+	if(final_blk_num == -1)
+		return -ENOSPC;
+	if(offset == 0)
+		memset(data_blk, 0, BLOCK_SIZE);
+	else
+		bio_read(final_blk_num, data_blk);
+	fdirent_store(data_blk + offset, entry);
+	if(debugInner)
+		printf("\n     -> Dirent for inode # %d of %s added to data_block # %d", entry->ino, entry->name, final_blk_num);
+	bio_write(final_blk_num, data_blk);
+	return 0;
+}
+
+static int linear_remove(struct inode *dir_inode, const char *fname, size_t name_len) {
+	if(VAR_DIRENTS){
+		if(dir_inode->size == 0)
+			return -ENOENT;
+		if(dir_inode->flags & INODE_FL_INLINE){
+			inline_dblk_load(dir_inode, data_blk);
+			int ret = dblk_remove(data_blk, fname, name_len);
+			if(ret == 0)
+				inline_dblk_store(dir_inode, data_blk);
+			return ret;
+		}
+		if(dx_read(dir_inode, 0, data_blk) < 0)
+			return -EIO;
+		int ret = dblk_remove(data_blk, fname, name_len);
+		if(ret < 0)
+			return ret;
+		if(dblk_is_empty(data_blk))
+			put_blkno(dir_inode, 0);
+		else
+			dx_write(dir_inode, 0, data_blk);
+		return 0;
+	}
+
+	int num_dirents = dir_inode->size/sizeof(struct fdirent);
+	int dirent_rem = -1;
+	int dirent_rem_blk = -1;
+
+	// Read directory's data block and check each directory entry.
+	// If the name matches, then update dirent_rem and dirent_rem_blk and stop
+	for(int k=0; k<num_dirents && dirent_rem == -1; k+=DIRENTS_PER_BLK){
+		int d_blk_num = get_blkno(dir_inode, k/DIRENTS_PER_BLK, 0);
+		int num_dirents_blk = (num_dirents - k > DIRENTS_PER_BLK) ? DIRENTS_PER_BLK : num_dirents - k;
+		if(d_blk_num == -1 || bio_read(d_blk_num, data_blk) < 0)
+			return -EIO;
+		struct fdirent *dirents = data_blk;
+		for(int i=0; i<num_dirents_blk; i++){
+			if(dirents[i].len == (int)name_len && strncmp(dirents[i].name, fname, name_len) == 0)
+			{
+				dirent_rem = k + i;
+				dirent_rem_blk = d_blk_num;
+				break;
+			}
+		}
+	}
+	if(dirent_rem == -1)
+		return -ENOENT;
+
+	// Keep the entries packed by moving the last entry into the hole
+	int last = num_dirents - 1;
+	int rem_offset = (dirent_rem % DIRENTS_PER_BLK)*sizeof(struct fdirent);
+	int last_offset = (last % DIRENTS_PER_BLK)*sizeof(struct fdirent);
+	int last_blk_num = get_blkno(dir_inode, last/DIRENTS_PER_BLK, 0);
+	if(last_blk_num == dirent_rem_blk){
+		memmove(data_blk + rem_offset, data_blk + last_offset, sizeof(struct fdirent));
+		memset(data_blk + last_offset, 0, sizeof(struct fdirent));
+	}
+	else{
+		bio_read(last_blk_num, data_blk2);
+		memcpy(data_blk + rem_offset, data_blk2 + last_offset, sizeof(struct fdirent));
+		memset(data_blk2 + last_offset, 0, sizeof(struct fdirent));
+		bio_write(last_blk_num, data_blk2);
+	}
+	bio_write(dirent_rem_blk, data_blk);
+
+	// Release the last block once it holds no entries
+	if(last_offset == 0)
+		put_blkno(dir_inode, last/DIRENTS_PER_BLK);
+	return 0;
+}
+
+static int linear_iterate(struct inode *dir_inode, dir_iter_fn fn, void *arg) {
+	char buf[BLOCK_SIZE];
+	if(VAR_DIRENTS){
+		if(dir_inode->size == 0)
+			return 0;
+		if(dir_inode->flags & INODE_FL_INLINE)
+			inline_dblk_load(dir_inode, buf);
+		else if(dx_read(dir_inode, 0, buf) < 0)
+			return -EIO;
+		return dblk_iterate(buf, fn, arg);
+	}
+
+	int num_dirents = dir_inode->size/sizeof(struct fdirent);
+
+	for(int k=0; k<num_dirents; k+=DIRENTS_PER_BLK){
+		int d_blk_num = get_blkno(dir_inode, k/DIRENTS_PER_BLK, 0);
+		int num_dirents_blk = (num_dirents - k > DIRENTS_PER_BLK) ? DIRENTS_PER_BLK : num_dirents - k;
+		if(d_blk_num == -1 || bio_read(d_blk_num, buf) < 0)
+			return -EIO;
+		struct fdirent *dirents = (struct fdirent *)buf;
+		struct dirent dirent;
+		for(int i=0; i<num_dirents_blk; i++){
+			fdirent_load(&dirent, &dirents[i]);
+			int ret = fn(arg, &dirent);
+			if(ret != 0)
+				return ret;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Hash indexed directories (htree)
+ *
+ * Once the first block of a linear directory fills up it is converted: block
+ * 0 becomes the root index and the entries move to leaf blocks chosen by the
+ * hash of their name. A full leaf is split in two at a hash boundary and the
+ * new half is added to its parent index, which splits in turn when full, so
+ * lookups, inserts and removes read one block per index level plus the leaf.
+ * Leaf blocks are arrays of dirent slots where valid marks a used slot.
+ */
+struct dx_frame {
+	int lblk;						/* logical block of the index block */
+	int at;							/* entry followed on the way down */
+	int count;						/* entries in the index block */
+};
+
+// FNV-1a, bit 0 is left clear for the collision continuation marker
+static uint32_t dx_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	for(size_t i=0; i<len; i++){
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h & ~1u;
+}
+
+// Allocate the next logical block of an indexed directory
+static int dx_new_block(struct inode *dir_inode) {
+	char buf[BLOCK_SIZE];
+	struct dx_header *root = (struct dx_header *)buf;
+	if(dx_read(dir_inode, 0, buf) < 0)
+		return -1;
+	int lblk = root->nblocks;
+	if(get_blkno(dir_inode, lblk, 1) == -1)
+		return -1;
+	root->nblocks++;
+	if(dx_write(dir_inode, 0, buf) < 0)
+		return -1;
+	return lblk;
+}
+
+/*
+ * Map the next n logical blocks up front so that a split which needs them
+ * cannot run out of space halfway through and lose entries. Returns the
+ * logical block after the reserved ones.
+ */
+static int dx_reserve(struct inode *dir_inode, int n) {
+	char buf[BLOCK_SIZE];
+	struct dx_header *root = (struct dx_header *)buf;
+	if(dx_read(dir_inode, 0, buf) < 0)
+		return -EIO;
+	for(int i=0; i<n; i++){
+		if(get_blkno(dir_inode, root->nblocks + i, 1) == -1){
+			while(i-- > 0)
+				put_blkno(dir_inode, root->nblocks + i);
+			return -ENOSPC;
+		}
+	}
+	return root->nblocks + n;
+}
+
+// Free the blocks dx_reserve() mapped up to end that a split left unused
+static void dx_unreserve(struct inode *dir_inode, int end) {
+	char buf[BLOCK_SIZE];
+	struct dx_header *root = (struct dx_header *)buf;
+	if(dx_read(dir_inode, 0, buf) < 0)
+		return;
+	for(int lblk = end - 1; lblk >= (int)root->nblocks; lblk--)
+		put_blkno(dir_inode, lblk);
+}
+
+struct leaf_split_ctx {
+	struct dirent *sorted;
+	uint32_t *hashes;
+	int n;
+};
+
+// Insertion sort of a leaf's entries by hash
+static int leaf_split_collect(void *arg, const struct dirent *dirent) {
+	struct leaf_split_ctx *ctx = arg;
+	uint32_t h = dx_hash(dirent->name, dirent->len);
+	int k = ctx->n++;
+	while(k > 0 && ctx->hashes[k-1] > h){
+		ctx->hashes[k] = ctx->hashes[k-1];
+		ctx->sorted[k] = ctx->sorted[k-1];
+		k--;
+	}
+	ctx->hashes[k] = h;
+	ctx->sorted[k] = *dirent;
+	return 0;
+}
+
+/*
+ * Move the upper half of src, by hash, into the empty leaf dst and set
+ * *split_hash to the lowest hash moved. If every entry shares one hash the
+ * halves get the same hash and *split_hash has the continuation bit set.
+ * src is left as it was when memory runs out.
+ */
+static int leaf_split(void *src, void *dst, uint32_t *split_hash) {
+	struct leaf_split_ctx ctx;
+	ctx.sorted = malloc(VDIRENTS_MAX_PER_BLK*sizeof(struct dirent));
+	ctx.hashes = malloc(VDIRENTS_MAX_PER_BLK*sizeof(uint32_t));
+	if(ctx.sorted == NULL || ctx.hashes == NULL){
+		free(ctx.sorted);
+		free(ctx.hashes);
+		return -ENOMEM;
+	}
+	ctx.n = 0;
+	dblk_iterate(src, leaf_split_collect, &ctx);
+	int n = ctx.n;
+	uint32_t *hashes = ctx.hashes;
+
+	// Split where half of the bytes are on each side, but never between
+	// two equal hashes if avoidable
+	int total = 0, half = 0, mid = 0;
+	for(int i=0; i<n; i++)
+		total += dirent_size(ctx.sorted[i].len);
+	while(mid < n - 1 && half < total/2)
+		half += dirent_size(ctx.sorted[mid++].len);
+	if(mid == 0)
+		mid = 1;
+	int at = mid;
+	while(at < n && hashes[at] == hashes[at-1])
+		at++;
+	if(at == n){
+		at = mid;
+		while(at > 0 && hashes[at] == hashes[at-1])
+			at--;
+	}
+	*split_hash = (at == 0) ? (hashes[mid] | 1) : hashes[at];
+	if(at == 0)
+		at = mid;
+
+	dblk_init(src);
+	dblk_init(dst);
+	for(int i=0; i<n; i++)
+		dblk_insert(i < at ? src : dst, &ctx.sorted[i]);
+	free(ctx.sorted);
+	free(ctx.hashes);
+	return 0;
+}
+
+/*
+ * Walk from the root to the leaf whose hash range covers hash, recording the
+ * index entry taken at each level. Returns the leaf's logical block.
+ */
+static int dx_probe(struct inode *dir_inode, uint32_t hash, struct dx_frame *frames, int *levels) {
+	char buf[BLOCK_SIZE];
+	struct dx_header *h = (struct dx_header *)buf;
+	struct dx_entry *entries = (struct dx_entry *)(h + 1);
+	int lblk = 0;
+
+	if(dx_read(dir_inode, 0, buf) < 0 || h->magic != DX_MAGIC || h->levels > DX_MAX_LEVELS)
+		return -EIO;
+	*levels = h->levels;
+	for(int level=0; level<=*levels; level++){
+		if(level > 0 && (dx_read(dir_inode, lblk, buf) < 0 || h->magic != DX_MAGIC))
+			return -EIO;
+		// Binary search for the last entry starting at or below hash
+		int lo = 1, hi = h->count - 1, at = 0;
+		while(lo <= hi){
+			int mid = (lo + hi)/2;
+			if(entries[mid].hash <= hash){
+				at = mid;
+				lo = mid + 1;
+			}
+			else
+				hi = mid - 1;
+		}
+		frames[level].lblk = lblk;
+		frames[level].at = at;
+		frames[level].count = h->count;
+		lblk = entries[at].lblk;
+	}
+	return lblk;
+}
+
+/*
+ * Advance frames to the next leaf in hash order and return it, or -1 after
+ * the last one. *hash is set to the index hash of the returned leaf.
+ */
+static int dx_next_leaf(struct inode *dir_inode, struct dx_frame *frames, int levels, uint32_t *hash) {
+	char buf[BLOCK_SIZE];
+	struct dx_header *h = (struct dx_header *)buf;
+	struct dx_entry *entries = (struct dx_entry *)(h + 1);
+	int level = levels;
+
+	// Climb to the lowest index block with entries left
+	while(level >= 0){
+		if(dx_read(dir_inode, frames[level].lblk, buf) < 0)
+			return -1;
+		if(frames[level].at + 1 < h->count)
+			break;
+		level--;
+	}
+	if(level < 0)
+		return -1;
+	frames[level].at++;
+	*hash = entries[frames[level].at].hash;
+	int lblk = entries[frames[level].at].lblk;
+
+	// Then follow the first entry of each block back down
+	for(level++; level<=levels; level++){
+		if(dx_read(dir_inode, lblk, buf) < 0)
+			return -1;
+		frames[level].lblk = lblk;
+		frames[level].at = 0;
+		frames[level].count = h->count;
+		lblk = entries[0].lblk;
+	}
+	return lblk;
+}
+
+/*
+ * Add an index entry for child lblk right after the entry taken at level,
+ * splitting full index blocks upwards and growing the tree at the root.
+ */
+static int dx_insert_entry(struct inode *dir_inode, struct dx_frame *frames, int level, uint32_t hash, int lblk) {
+	char buf[BLOCK_SIZE], buf2[BLOCK_SIZE];
+	struct dx_header *h = (struct dx_header *)buf;
+	struct dx_entry *entries = (struct dx_entry *)(h + 1);
+	struct dx_header *h2 = (struct dx_header *)buf2;
+	struct dx_entry *entries2 = (struct dx_entry *)(h2 + 1);
+	int at = frames[level].at + 1;
+
+	if(dx_read(dir_inode, frames[level].lblk, buf) < 0)
+		return -EIO;
+	if(h->count < DX_ENTRIES_PER_BLK){
+		memmove(&entries[at+1], &entries[at], (h->count - at)*sizeof(struct dx_entry));
+		entries[at].hash = hash;
+		entries[at].lblk = lblk;
+		h->count++;
+		return dx_write(dir_inode, frames[level].lblk, buf);
+	}
+
+	if(level == 0){
+		// The root is full: move its entries into a new index block below it
+		if(h->levels >= DX_MAX_LEVELS)
+			return -ENOSPC;
+		int child = dx_new_block(dir_inode);
+		if(child < 0 || dx_read(dir_inode, 0, buf) < 0)
+			return -ENOSPC;
+		int levels = h->levels;
+		memcpy(buf2, buf, BLOCK_SIZE);
+		h2->levels = 0;
+		h2->nblocks = 0;
+		h->levels++;
+		h->count = 1;
+		entries[0].hash = 0;
+		entries[0].lblk = child;
+		if(dx_write(dir_inode, child, buf2) < 0 || dx_write(dir_inode, 0, buf) < 0)
+			return -EIO;
+
+		// The path down now goes through the new block
+		memmove(&frames[1], &frames[0], (levels + 1)*sizeof(struct dx_frame));
+		frames[0].at = 0;
+		frames[1].lblk = child;
+		return dx_insert_entry(dir_inode, frames, 1, hash, lblk);
+	}
+
+	// Split a full index block in half and add the upper half to the parent
+	int sibling = dx_new_block(dir_inode);
+	if(sibling < 0)
+		return -ENOSPC;
+	int half = h->count/2;
+	memset(buf2, 0, BLOCK_SIZE);
+	h2->magic = DX_MAGIC;
+	h2->count = h->count - half;
+	memcpy(entries2, &entries[half], h2->count*sizeof(struct dx_entry));
+	h->count = half;
+
+	struct dx_header *th = (at > half) ? h2 : h;
+	struct dx_entry *tentries = (at > half) ? entries2 : entries;
+	int tat = (at > half) ? at - half : at;
+	memmove(&tentries[tat+1], &tentries[tat], (th->count - tat)*sizeof(struct dx_entry));
+	tentries[tat].hash = hash;
+	tentries[tat].lblk = lblk;
+	th->count++;
+
+	if(dx_write(dir_inode, frames[level].lblk, buf) < 0 || dx_write(dir_inode, sibling, buf2) < 0)
+		return -EIO;
+	return dx_insert_entry(dir_inode, frames, level - 1, entries2[0].hash, sibling);
+}
+
+/*
+ * Convert a linear directory whose only block is full into an indexed one
+ */
+static int dx_make_indexed(struct inode *dir_inode) {
+	char root[BLOCK_SIZE], leaf1[BLOCK_SIZE], leaf2[BLOCK_SIZE];
+	struct dx_header *h = (struct dx_header *)root;
+	struct dx_entry *entries = (struct dx_entry *)(h + 1);
+
+	if(dx_read(dir_inode, 0, leaf1) < 0)
+		return -EIO;
+	if(get_blkno(dir_inode, 1, 1) == -1 || get_blkno(dir_inode, 2, 1) == -1){
+		put_blkno(dir_inode, 1);
+		return -ENOSPC;
+	}
+	uint32_t split_hash;
+	if(leaf_split(leaf1, leaf2, &split_hash) < 0){
+		put_blkno(dir_inode, 2);
+		put_blkno(dir_inode, 1);
+		return -ENOMEM;
+	}
+
+	memset(root, 0, BLOCK_SIZE);
+	h->magic = DX_MAGIC;
+	h->levels = 0;
+	h->count = 2;
+	h->nblocks = 3;
+	entries[0].hash = 0;
+	entries[0].lblk = 1;
+	entries[1].hash = split_hash;
+	entries[1].lblk = 2;
+	if(dx_write(dir_inode, 1, leaf1) < 0 || dx_write(dir_inode, 2, leaf2) < 0 || dx_write(dir_inode, 0, root) < 0)
+		return -EIO;
+
+	dir_inode->flags |= INODE_FL_INDEX;
+	imark_dirty(dir_inode);
+	if(debugInner)
+		printf("\n     -> Directory inode # %d converted to an indexed directory", dir_inode->ino);
+	return 0;
+}
+
+static int dx_find(struct inode *dir_inode, const char *fname, size_t name_len, struct dirent *dirent, int remove) {
+	struct dx_frame frames[DX_MAX_LEVELS + 1];
+	uint32_t hash = dx_hash(fname, name_len);
+	uint32_t next_hash;
+	int levels;
+
+	int leaf = dx_probe(dir_inode, hash, frames, &levels);
+	if(leaf < 0)
+		return -EIO;
+	while(1){
+		// Leaves are searched, and entries removed, in place
+		int blk_num = get_blkno(dir_inode, leaf, 0);
+		void *buf = (blk_num == -1) ? NULL : bio_get(blk_num);
+		if(buf == NULL)
+			return -EIO;
+		if(dblk_find(buf, fname, name_len, dirent) == 0){
+			if(remove)
+				dblk_remove(buf, fname, name_len);
+			bio_put(blk_num, buf, remove);
+			return 0;
+		}
+		bio_put(blk_num, buf, 0);
+		// Names with the same hash may continue in the next leaf
+		leaf = dx_next_leaf(dir_inode, frames, levels, &next_hash);
+		if(leaf < 0 || next_hash != (hash | 1))
+			return remove ? -ENOENT : -1;
+	}
+}
+
+static int dx_add(struct inode *dir_inode, const struct dirent *entry) {
+	char buf[BLOCK_SIZE], buf2[BLOCK_SIZE];
+	struct dx_frame frames[DX_MAX_LEVELS + 1];
+	uint32_t hash = dx_hash(entry->name, entry->len);
+	int levels;
+
+	int leaf = dx_probe(dir_inode, hash, frames, &levels);
+	if(leaf < 0 || dx_read(dir_inode, leaf, buf) < 0)
+		return -EIO;
+	if(dblk_insert(buf, entry) == 0)
+		return dx_write(dir_inode, leaf, buf);
+
+	// The leaf is full: count the index blocks that split along with it,
+	// a full root takes a new child as well
+	int need = 1;
+	int level = levels;
+	while(level >= 0 && frames[level].count >= DX_ENTRIES_PER_BLK){
+		need++;
+		level--;
+	}
+	if(level < 0 && levels >= DX_MAX_LEVELS)
+		return -ENOSPC;
+	if(level < 0)
+		need++;
+	int end = dx_reserve(dir_inode, need);
+	if(end < 0)
+		return end;
+
+	// Then split it by hash and index the new half. Whatever fails, the
+	// reserved blocks the split did not take are given back.
+	uint32_t split_hash;
+	int ret = leaf_split(buf, buf2, &split_hash);
+	if(ret < 0){
+		dx_unreserve(dir_inode, end);
+		return ret;
+	}
+	int new_leaf = dx_new_block(dir_inode);
+	if(new_leaf < 0){
+		dx_unreserve(dir_inode, end);
+		return -ENOSPC;
+	}
+	ret = dblk_insert((hash < (split_hash & ~1u)) ? buf : buf2, entry);
+	if(dx_write(dir_inode, leaf, buf) < 0 || dx_write(dir_inode, new_leaf, buf2) < 0 ||
+	   dx_insert_entry(dir_inode, frames, levels, split_hash, new_leaf) < 0)
+		ret = -EIO;
+	dx_unreserve(dir_inode, end);
+
+	// Only a leaf full of one colliding hash can still be out of room
+	return ret;
+}
+
+// Free every block of an indexed directory that has become empty
+static void dx_release(struct inode *dir_inode) {
+	char buf[BLOCK_SIZE];
+	struct dx_header *root = (struct dx_header *)buf;
+	if(dx_read(dir_inode, 0, buf) < 0)
+		return;
+	for(int lblk = root->nblocks - 1; lblk >= 0; lblk--)
+		put_blkno(dir_inode, lblk);
+	dir_inode->flags &= ~INODE_FL_INDEX;
+	imark_dirty(dir_inode);
+}
+
+static int dx_iterate(struct inode *dir_inode, dir_iter_fn fn, void *arg) {
+	char buf[BLOCK_SIZE];
+	struct dx_frame frames[DX_MAX_LEVELS + 1];
+	uint32_t hash;
+	int levels;
+
+	int leaf = dx_probe(dir_inode, 0, frames, &levels);
+	if(leaf < 0)
+		return -EIO;
+	while(leaf >= 0){
+		if(dx_read(dir_inode, leaf, buf) < 0)
+			return -EIO;
+		int ret = dblk_iterate(buf, fn, arg);
+		if(ret != 0)
+			return ret;
+		leaf = dx_next_leaf(dir_inode, frames, levels, &hash);
+	}
 	return 0;
 }
 
+/*
+ * Call fn for every entry of a directory until it returns non-zero
+ */
+int dir_iterate(struct inode *dir_inode, dir_iter_fn fn, void *arg) {
+	if(dir_inode->flags & INODE_FL_INDEX)
+		return dx_iterate(dir_inode, fn, arg);
+	return linear_iterate(dir_inode, fn, arg);
+}
 
-/* 
- * directory operations
+/*
+ * Look up fname in a directory the caller holds locked, through the dentry
+ * cache first
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+static int dir_lookup(struct inode *dir_inode, const char *fname, size_t name_len, struct dirent *dirent) {
+	int ret = -1;
+	int cached_ino;
+	int cached = dcache_lookup(dir_inode->ino, fname, name_len, &cached_ino);
+	if(cached == 1){
+		memset(dirent, 0, sizeof(struct dirent));
+		dirent->ino = cached_ino;
+		dirent->valid = 1;
+		dirent->len = name_len;
+		memcpy(dirent->name, fname, name_len);
+		ret = 0;
+	}
+	else if(cached == -1){
+		if(dir_inode->flags & INODE_FL_INDEX)
+			ret = dx_find(dir_inode, fname, name_len, dirent, 0);
+		else
+			ret = linear_find(dir_inode, fname, name_len, dirent);
+		if(ret != -EIO)
+			dcache_insert(dir_inode->ino, fname, name_len, (ret == 0) ? dirent->ino : -1);
+	}
+	return ret;
+}
+
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
 
 	if(debugOuter)
 		printf("\n---> ENTERING dir_find to find %s in parent_dir inode # %d", fname, ino);
 
-  	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
-	struct inode dir_inode;
-	readi(ino, &dir_inode);
+  	// Step 1: Call iget() to get the inode using ino (inode number of current directory)
+	struct inode *dir_inode = iget(ino);
+	if(dir_inode == NULL)
+		return -EIO;
 
-	// Step 2: Get data block of current directory from inode
-	int d_blk_num = 0;	
-	int size_read = 0;
-	int num_dirents = dir_inode.size/sizeof(struct dirent);
-	if(debugInner)
-		printf("\n     -> Num Dirents in parent_dir is %d", num_dirents);
-	// Step 3: Read directory's data block and check each directory entry.
-	//If the name matches, then copy directory entry to dirent structure
-	while(dir_inode.direct_ptr[d_blk_num] != -1 && d_blk_num < 16 && size_read < dir_inode.size){
-		int num_dirents_blk = (num_dirents > (BLOCK_SIZE/sizeof(struct dirent))) ? (BLOCK_SIZE/sizeof(struct dirent)) : num_dirents;
-		if(debugInner)
-			printf("\n     -> Num Dirents in block # %d is %d", dir_inode.direct_ptr[d_blk_num], num_dirents_blk);
-		memset(data_blk, 0, BLOCK_SIZE);
-		if(bio_read(dir_inode.direct_ptr[d_blk_num], data_blk) < 0){
-			if(debugOuter)
-				printf("\n---> EXITING dir_find with status FAILURE\n");
-			return -EIO;
-		}
-		struct dirent *dirents = data_blk;
-		for(int i=0; i<num_dirents_blk; i++){
-			if(strncmp(dirents[i].name, fname, name_len) == 0 && dirents[i].len == (int)name_len)
-			{
-				memcpy(dirent, &dirents[i], sizeof(struct dirent));
-
-				//Update accesstime in dir_inode
-				time_t current_time = time(NULL);
-				dir_inode.vstat.st_atime = current_time;
-				writei(ino, &dir_inode);
-				if(debugInner)
-					printf("\n    -> SUCCESSFULLY FOUND THE ENTRY NAME %s\n",fname);
-				if(debugOuter)
-					printf("\n---> EXITING dir_find with status SUCCESS\n");
-				return 0;
-			}
-		}
-		num_dirents -= num_dirents_blk;
-		size_read += num_dirents_blk*sizeof(struct dirent);
-		d_blk_num++;
-	}
-	while(dir_inode.indirect_ptr[d_blk_num-16] != -1 && d_blk_num >= 16 && size_read < dir_inode.size){
-		memset(data_blk, 0, BLOCK_SIZE);
-		if(bio_read(dir_inode.indirect_ptr[d_blk_num-16], data_blk) < 0){
-			if(debugOuter)
-				printf("\n---> EXITING dir_find with status FAILURE\n");
-			return -EIO;
-		}
-		int *ind_blk_nums = (int *)data_blk;
-		int k=0;
-		while(d_blk_num >= 16 && size_read < dir_inode.size){
-			if(debugInner){
-				printf("\n     -> Block for k = %d is %d", k, ind_blk_nums[k]);
-				fflush(stdout);
-			}
-		int num_dirents_blk = (num_dirents > (BLOCK_SIZE/sizeof(struct dirent))) ? (BLOCK_SIZE/sizeof(struct dirent)) : num_dirents;
-		if(debugInner)
-			printf("\n     -> Num Dirents in block # %d is %d", dir_inode.direct_ptr[d_blk_num], num_dirents_blk);
-		memset(data_blk2, 0, BLOCK_SIZE);
-		if(bio_read(ind_blk_nums[k], data_blk2) < 0){
-			if(debugOuter)
-				printf("\n---> EXITING dir_find with status FAILURE\n");
-			return -EIO;
-		}
+	// Step 2: Check the dentry cache, then read directory's data blocks and check
+	// the directory entries. If the name matches, copy directory entry to dirent
+	irlock(dir_inode);
+	int ret = dir_lookup(dir_inode, fname, name_len, dirent);
 
-		struct dirent *dirents = data_blk2;
-		for(int i=0; i<num_dirents_blk; i++){
-			if(strncmp(dirents[i].name, fname, name_len) == 0 && dirents[i].len == (int)name_len)
-			{
-				memcpy(dirent, &dirents[i], sizeof(struct dirent));
-
-				//Update accesstime in dir_inode
-				time_t current_time = time(NULL);
-				dir_inode.vstat.st_atime = current_time;
-				writei(ino, &dir_inode);
-				if(debugInner)
-					printf("\n    -> SUCCESSFULLY FOUND THE ENTRY NAME %s\n",fname);
-				if(debugOuter)
-					printf("\n---> EXITING dir_find with status SUCCESS\n");
-				return 0;
-			}
-		}
-		num_dirents -= num_dirents_blk;
-		size_read += num_dirents_blk*sizeof(struct dirent);
-		k++;
-	}
-	d_blk_num++;
+	if(ret == 0){
+		if(debugInner)
+			printf("\n    -> SUCCESSFULLY FOUND THE ENTRY NAME %s\n",fname);
 	}
+	iunlock(dir_inode);
+	iput(dir_inode);
 	if(debugOuter)
-		printf("\n---> EXITING dir_find with status FAILURE\n");
-	return -1;
+		printf("\n---> EXITING dir_find with status %s\n", ret == 0 ? "SUCCESS" : "FAILURE");
+	return ret;
 }
-
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+int dir_add(struct inode *dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
 
 	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
 	// Step 2: Check if fname (directory name) is already used in other entries
 	if(debugOuter)
-		printf("\n---> ENTERING dir_add to add %s in parent_dir inode # %d", fname, dir_inode.ino);
+		printf("\n---> ENTERING dir_add to add %s in parent_dir inode # %d", fname, dir_inode->ino);
 	
+	if(name_len > DIRENT_NAME_MAX){
+		if(debugOuter)
+			printf("\n---> EXITING dir_add with status FAILURE\n");
+		return -ENAMETOOLONG;
+	}
+
+	// The check and the insert happen under one write lock, and a directory
+	// removed while we waited for the lock takes no new entries
+	iwlock(dir_inode);
+	if(!dir_inode->valid){
+		iunlock(dir_inode);
+		return -ENOENT;
+	}
 	struct dirent entry;
-	if(dir_inode.direct_ptr[0] != -1 && dir_find(dir_inode.ino, fname, name_len, &entry) == 0){
+	if(dir_inode->size > 0 && dir_lookup(dir_inode, fname, name_len, &entry) == 0){
 		if(debugInner)
 			printf("\n     -> File with name %s already exists", fname);
 		if(debugOuter)
 				printf("\n---> EXITING dir_add with status FAILURE\n");
+		iunlock(dir_inode);
 		return -EEXIST;
 	}
 
 	// Step 3: Add directory entry in dir_inode's data block and write to disk
+	memset(&entry, 0, sizeof(struct dirent));
 	entry.ino = f_ino;
 	entry.len = name_len;
 	strncpy(entry.name, fname, name_len);
 	entry.name[name_len] = '\0';
 	entry.valid = 1;
-	
-	int d_blk_num = (dir_inode.size/sizeof(struct dirent))/(BLOCK_SIZE/sizeof(struct dirent));
-	int ind_blk_num = 0;
-	int ind_blk_offset = 0;
-	int offset = ((dir_inode.size/sizeof(struct dirent)) % (BLOCK_SIZE/sizeof(struct dirent)))*sizeof(struct dirent);
-	// Allocate a new data block for this directory if it does not exist
-	if(d_blk_num < 16 && dir_inode.direct_ptr[d_blk_num] == -1){
-		offset = 0;
-		int blk_num = get_avail_blkno();
-		if(blk_num == -1){
-			return -ENOMEM;
-		}
-		dir_inode.direct_ptr[d_blk_num] = blk_num;
-		if(debugInner)
-			printf("\n     -> New Data Block numbered %d allocated for Inode # %d", blk_num, dir_inode.ino);
-		writei(dir_inode.ino, &dir_inode);
-	}
-	else if(d_blk_num >= 16){
-		ind_blk_num = (d_blk_num-16) / (BLOCK_SIZE/sizeof(int));
-		ind_blk_offset = ((d_blk_num-16) % (BLOCK_SIZE/sizeof(int)))*sizeof(int);
-		if(dir_inode.indirect_ptr[ind_blk_num] == -1){
-			int ptr_blk_num = get_avail_blkno();
-			if(ptr_blk_num == -1){
-				return -ENOMEM;
-			}
-			dir_inode.indirect_ptr[ind_blk_num] = ptr_blk_num;
-			memset(data_blk, -1, BLOCK_SIZE);
-			bio_write(ptr_blk_num, data_blk);
-			writei(dir_inode.ino, &dir_inode);
-		}
-		if(offset == 0){
-			memset(data_blk, 0, BLOCK_SIZE);
-			bio_read(dir_inode.indirect_ptr[ind_blk_num], data_blk);
-			int new_block = get_avail_blkno();
-			if(new_block == -1){
-				return -ENOMEM;
-			}
-			memcpy(data_blk + ind_blk_offset, &new_block, sizeof(int));
-			bio_write(dir_inode.indirect_ptr[ind_blk_num], data_blk);
+
+	// A linear directory is indexed once its first block is full
+	int ret;
+	if(dir_inode->flags & INODE_FL_INDEX)
+		ret = dx_add(dir_inode, &entry);
+	else{
+		ret = linear_add(dir_inode, &entry);
+		if(ret == 1){
+			ret = dx_make_indexed(dir_inode);
+			if(ret == 0)
+				ret = dx_add(dir_inode, &entry);
 		}
 	}
-	struct dirent *dirent_addr;
-	int final_blk_num;
-	if(d_blk_num < 16){
-		memset(data_blk, 0, BLOCK_SIZE);
-		final_blk_num = dir_inode.direct_ptr[d_blk_num];
-		bio_read(final_blk_num, data_blk);
-		dirent_addr = data_blk + offset;
-	}
-	else
-	{
-		memset(data_blk, 0, BLOCK_SIZE);
-		bio_read(dir_inode.indirect_ptr[ind_blk_num], data_blk);
-		void *blk_num_addr = data_blk + ind_blk_offset;
-		memcpy(&final_blk_num, blk_num_addr, sizeof(int));
-		memset(data_blk, 0, BLOCK_SIZE);
-		bio_read(final_blk_num, data_blk);
-		dirent_addr = data_blk + offset;
-	}
-	memcpy(dirent_addr, &entry, sizeof(struct dirent));
-	if(debugInner)
-		printf("\n     -> Dirent for inode # %d of %s added to data_block # %d", f_ino, fname, final_blk_num);
-	bio_write(final_blk_num, data_blk);
-	
-	if(debugInner){
-		memset(data_blk, 0, BLOCK_SIZE);
-		bio_read(final_blk_num, data_blk);
-		struct dirent x;
-		memcpy(&x, data_blk + offset, sizeof(struct dirent));
-		printf("\n     -> the recent added enrty's name is %s with len %d\n", x.name, x.len);
+	if(ret < 0){
+		if(debugOuter)
+			printf("\n---> EXITING dir_add with status FAILURE\n");
+		iunlock(dir_inode);
+		return ret;
 	}
 	
 	// Update directory inode
-	dir_inode.size += sizeof(struct dirent);
-	dir_inode.vstat.st_size = dir_inode.size;
+	dir_inode->size += dirent_size(name_len);
 	
-	time_t current_time = time(NULL);
-	dir_inode.vstat.st_atime = current_time;
-	dir_inode.vstat.st_mtime = current_time;
+	struct timespec current_time;
+	clock_gettime(CLOCK_REALTIME, &current_time);
+	dir_inode->atime = current_time;
+	dir_inode->mtime = current_time;
+	dir_inode->ctime = current_time;
 
 	// Write directory entry
-	writei(dir_inode.ino, &dir_inode);
+	imark_dirty(dir_inode);
+	dcache_insert(dir_inode->ino, fname, name_len, f_ino);
+	iunlock(dir_inode);
 	if(debugInner)
-		printf("\n     -> Inode for parent_dir with inode # %d Updated atime and mtime", dir_inode.ino);
+		printf("\n     -> Inode for parent_dir with inode # %d Updated atime and mtime", dir_inode->ino);
 	
 	if(debugOuter)
 		printf("\n---> EXITING dir_add with status SUCCESS\n");
 	return 0;
 }
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+int dir_remove(struct inode *dir_inode, const char *fname, size_t name_len) {
 
 	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
 	// Step 2: Check if fname exist
 	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
 	if(debugOuter)
-		printf("\n---> ENTERING dir_remove to remove %s with len %d from parent_dir inode # %d", fname, (int)name_len, dir_inode.ino);
-		
-  	struct dirent* dirent_rem_addr;
-	int dirent_rem_blk = -1;
+		printf("\n---> ENTERING dir_remove to remove %s with len %d from parent_dir inode # %d", fname, (int)name_len, dir_inode->ino);
+
+	int ret;
+	iwlock(dir_inode);
+	if(dir_inode->flags & INODE_FL_INDEX)
+		ret = dx_find(dir_inode, fname, name_len, NULL, 1);
+	else
+		ret = linear_remove(dir_inode, fname, name_len);
+	if(ret < 0){
+		if(debugOuter)
+			printf("\n---> EXITING dir_remove with status FAILURE\n");
+		iunlock(dir_inode);
+		return ret;
+	}
+
+	// Step 4: Update directory inode, an emptied index gives back its blocks
+	dir_inode->size -= dirent_size(name_len);
+	if(dir_inode->size == 0 && (dir_inode->flags & INODE_FL_INDEX))
+		dx_release(dir_inode);
+
+	struct timespec current_time;
+	clock_gettime(CLOCK_REALTIME, &current_time);
+	dir_inode->atime = current_time;
+	dir_inode->mtime = current_time;
+	dir_inode->ctime = current_time;
+	imark_dirty(dir_inode);
+	dcache_insert(dir_inode->ino, fname, name_len, -1);
+	iunlock(dir_inode);
 	
-	int d_blk_num = 0;	
-	int size_read = 0;
-	int num_dirents = dir_inode.size/sizeof(struct dirent);
-	if(debugInner)
-		printf("\n     -> Num Dirents in parent_dir is %d", num_dirents);
-	// Step 4: Read directory's data block and check each directory entry.
-	// If the name matches, then update dirent_rem_blk and dirent_rem_addr and break
-	while(dirent_rem_blk == -1 && dir_inode.direct_ptr[d_blk_num] != -1 && d_blk_num < 16 && size_read < dir_inode.size){
-		int num_dirents_blk = (num_dirents > (BLOCK_SIZE/sizeof(struct dirent))) ? (BLOCK_SIZE/sizeof(struct dirent)) : num_dirents;
-		if(debugInner)
-			printf("\n     -> Num Dirents in block # %d is %d", dir_inode.direct_ptr[d_blk_num], num_dirents_blk);
-		memset(data_blk, 0, BLOCK_SIZE);
-		if(bio_read(dir_inode.direct_ptr[d_blk_num], data_blk) < 0){
+	if(debugOuter)
+		printf("\n---> EXITING dir_remove with status SUCCESS\n");
+	return 0;
+}
+
+/* 
+ * namei operation
+ */
+int get_ino_by_path(const char *path, uint32_t ino, uint32_t *target) {
+	
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	if(debugOuter)
+		printf("\n---> ENTERING get_ino_by_path to find node for %s", path);
+	const char *fname = path;
+	struct dirent entry;
+	while(*fname != '\0'){
+		// Skip separators, then look up the next component in the current directory
+		while(*fname == '/')
+			fname++;
+		if(*fname == '\0')
+			break;
+		const char *end = strchr(fname, '/');
+		size_t name_len = (end != NULL) ? (size_t)(end - fname) : strlen(fname);
+		if(dir_find(ino, fname, name_len, &entry) < 0){
+			if(debugInner)
+				printf("\n     -> Entry not found for %s", fname);
 			if(debugOuter)
-				printf("\n---> 1 EXITING dir_find with status FAILURE\n");
-			return -EIO;
-		}
-		struct dirent *dirents = data_blk;
-		for(int i=0; i<num_dirents_blk; i++){
-			if(strncmp(dirents[i].name, fname, name_len) == 0 && dirents[i].len == (int)name_len)
-			{
-				dirent_rem_addr = &dirents[i];
-				dirent_rem_blk = dir_inode.direct_ptr[d_blk_num];
-				dir_inode.size -= sizeof(struct dirent);
-				
-				// First dirent in block & the only dirent in block
-				if(i == 0 && num_dirents_blk == 1){
-					// Deallocate this block
-					memset(&dirents[i], 0, sizeof(struct dirent));
-					bio_write(dir_inode.direct_ptr[d_blk_num], data_blk);
-					unset_bitmap(data_bitmap, dir_inode.direct_ptr[d_blk_num] - my_super_block->d_start_blk);
-					dir_inode.direct_ptr[d_blk_num] = -1;
-					
-					// Update accesstime in dir_inode
-					time_t current_time = time(NULL);
-					dir_inode.vstat.st_atime = current_time;
-				
-					writei(dir_inode.ino, &dir_inode);
-					return 0;
-				}
-				break;
-			}
+				printf("\n---> EXITING from get_ino_by_path with status FAILURE\n");
+			return -1;
 		}
-		num_dirents -= num_dirents_blk;
-		size_read += num_dirents_blk*sizeof(struct dirent);
-		d_blk_num++;
+		ino = entry.ino;
+		fname += name_len;
 	}
-	while(dirent_rem_blk == -1 && d_blk_num >= 16 && dir_inode.indirect_ptr[d_blk_num-16] != -1 && size_read < dir_inode.size){
-		memset(data_blk2, 0, BLOCK_SIZE);
-		if(bio_read(dir_inode.indirect_ptr[d_blk_num-16], data_blk2) < 0){
-			if(debugOuter)
-				printf("\n---> 2 EXITING dir_find with status FAILURE\n");
-			return -EIO;
-		}
-		int *ind_blk_nums = (int *)data_blk2;
-		int k=0;
-		while(d_blk_num >= 16 && size_read < dir_inode.size){
-		int num_dirents_blk = (num_dirents > (BLOCK_SIZE/sizeof(struct dirent))) ? (BLOCK_SIZE/sizeof(struct dirent)) : num_dirents;
-		if(debugInner)
-			printf("\n     -> Num Dirents in block # %d is %d", dir_inode.direct_ptr[d_blk_num], num_dirents_blk);
-		memset(data_blk, 0, BLOCK_SIZE);
-		if(bio_read(ind_blk_nums[k], data_blk) < 0){
-			if(debugOuter)
-				printf("\n---> 3 EXITING dir_find with status FAILURE\n");
-			return -EIO;
-		}
+	*target = ino;
+	if(debugOuter)
+		printf("\n---> EXITING from get_ino_by_path with status SUCCESS\n");
+	return 0;
+}
 
-		struct dirent *dirents = data_blk;
-		for(int i=0; i<num_dirents_blk; i++){
-			if(strncmp(dirents[i].name, fname, name_len) == 0 && dirents[i].len == (int)name_len)
-			{
-				dirent_rem_addr = &dirents[i];
-				dirent_rem_blk = ind_blk_nums[k];
-				dir_inode.size -= sizeof(struct dirent);
-				//Write code to deallocate block if last and first entry in block
-				if(i==0 && num_dirents_blk == 1){
-					//deallocate this block
-					memset(&dirents[i], 0, sizeof(struct dirent));
-					bio_write(dirent_rem_blk, data_blk);
-					unset_bitmap(data_bitmap, ind_blk_nums[k] - my_super_block->d_start_blk);
-					memset(&ind_blk_nums[k], -1, sizeof(int));
-					bio_write(dir_inode.indirect_ptr[d_blk_num-16], data_blk2);
-					if(k == 0){
-						unset_bitmap(data_bitmap, dir_inode.indirect_ptr[d_blk_num-16] - my_super_block->d_start_blk);
-						dir_inode.indirect_ptr[d_blk_num-16] = -1;
-					}
-					
-					//Update accesstime in dir_inode
-					time_t current_time = time(NULL);
-					dir_inode.vstat.st_atime = current_time;
-				
-					writei(dir_inode.ino, &dir_inode);
-					return 0;	
-				}
-				break;
-			}
-		}
-		num_dirents -= num_dirents_blk;
-		size_read += num_dirents_blk*sizeof(struct dirent);
-		k++;
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode) {
+	
+	uint32_t target;
+	if(get_ino_by_path(path, ino, &target) < 0)
+		return -1;
+	if(debugInner)
+		printf("\n     -> Inode for %s is %d\n", path, target);
+	return readi(target, inode);
+}
+
+/*
+ * Size the in-memory bitmaps for the superblock's layout and allocate them
+ * cleared, see "Block groups" above for how they are indexed
+ */
+static void bitmaps_alloc() {
+	if(GROUPED){
+		int bpg = my_super_block->blocks_per_group;
+		groups_count = (my_super_block->blocks_count + bpg - 1) / bpg;
+		dmap_base = 0;
+		inode_bitmap_len = groups_count * (my_super_block->inodes_per_group / 8);
+		data_bitmap_len = groups_count * BLOCK_SIZE;
+		group_free_inodes = calloc(groups_count, sizeof(int));
 	}
-	d_blk_num++;
+	else{
+		groups_count = 1;
+		dmap_base = my_super_block->d_start_blk;
+		inode_bitmap_len = (my_super_block->d_bitmap_blk - my_super_block->i_bitmap_blk) * BLOCK_SIZE;
+		data_bitmap_len = (my_super_block->i_start_blk - my_super_block->d_bitmap_blk) * BLOCK_SIZE;
 	}
+	inode_bitmap = calloc(1, inode_bitmap_len);
+	data_bitmap = calloc(1, data_bitmap_len);
+	pa_bitmap = calloc(1, data_bitmap_len);
+	pa_blocks = 0;
+	free_pending = calloc(1, data_bitmap_len);
+	pending_blocks = 0;
+	ordered_bitmap = calloc(1, data_bitmap_len);
+
+	// Everything is dirty until bitmaps_load() says the disk has it
+	imap_blocks = GROUPED ? groups_count : inode_bitmap_len / BLOCK_SIZE;
+	dmap_blocks = data_bitmap_len / BLOCK_SIZE;
+	imap_dirty = malloc((imap_blocks + 7) / 8);
+	dmap_dirty = malloc((dmap_blocks + 7) / 8);
+	pend_map = calloc(1, (dmap_blocks + 7) / 8);
+	ordered_map = calloc(1, (dmap_blocks + 7) / 8);
+	memset(imap_dirty, 0xff, (imap_blocks + 7) / 8);
+	memset(dmap_dirty, 0xff, (dmap_blocks + 7) / 8);
+}
 
-	if(dirent_rem_blk == -1){
-		if(debugOuter)
-				printf("\n---> 1 EXITING dir_find with status FAILURE\n");
-		return -1;
+// Set the free counts from the bitmaps, once they are loaded or made
+static void bitmaps_count() {
+	int used = 0;
+	for(int w=0; w*64 < (int)my_super_block->inodes_count; w++)
+		used += __builtin_popcountll(get_bitmap_word(inode_bitmap, w));
+	num_free_inodes = my_super_block->inodes_count - used;
+
+	int nbits = (int)my_super_block->blocks_count - dmap_base;
+	used = 0;
+	for(int w=0; w*64 < nbits; w++)
+		used += __builtin_popcountll(get_bitmap_word(data_bitmap, w));
+	num_free_blocks = nbits - used;
+}
+
+// Read the bitmaps from disk, one block of each per group with block groups
+static void bitmaps_load() {
+	if(!GROUPED){
+		bio_readv(my_super_block->i_bitmap_blk, inode_bitmap_len / BLOCK_SIZE, inode_bitmap);
+		bio_readv(my_super_block->d_bitmap_blk, data_bitmap_len / BLOCK_SIZE, data_bitmap);
 	}
-	
-	d_blk_num = (dir_inode.size/sizeof(struct dirent))/(BLOCK_SIZE/sizeof(struct dirent));
-	int ind_blk_num = 0;
-	int ind_blk_offset = 0;
-	int offset = ((dir_inode.size/sizeof(struct dirent)) % (BLOCK_SIZE/sizeof(struct dirent)))*sizeof(struct dirent);
-	struct dirent *last_dirent_addr;
-	int final_blk_num;
-	if(d_blk_num < 16){
-		if(dir_inode.direct_ptr[d_blk_num] == -1)
-			return -1;
-		final_blk_num = dir_inode.direct_ptr[d_blk_num];
+	int ipg = my_super_block->inodes_per_group;
+	for(int g=0; GROUPED && g<groups_count; g++){
+		bio_read(group_start(g) + my_super_block->d_bitmap_blk, data_bitmap + g*BLOCK_SIZE);
+		bio_read(group_start(g) + my_super_block->i_bitmap_blk, data_blk);
+		memcpy(inode_bitmap + g*(ipg/8), data_blk, ipg/8);
+		group_free_inodes[g] = ipg;
+		for(int w=g*(ipg/64); w<(g+1)*(ipg/64); w++)
+			group_free_inodes[g] -= __builtin_popcountll(get_bitmap_word(inode_bitmap, w));
 	}
-	else if(d_blk_num >= 16){
-		ind_blk_num = (d_blk_num-16) / (BLOCK_SIZE/sizeof(int));
-		ind_blk_offset = ((d_blk_num-16) % (BLOCK_SIZE/sizeof(int)))*sizeof(int);
-		if(dir_inode.indirect_ptr[ind_blk_num] == -1)
-			return -1;
-		memset(data_blk3, 0, BLOCK_SIZE);
-		bio_read(dir_inode.indirect_ptr[ind_blk_num], data_blk3);
-		void *blk_num_addr = data_blk3 + ind_blk_offset;
-		memcpy(&final_blk_num, blk_num_addr, sizeof(int));
-		if(final_blk_num == -1)
-			return -1;
+	memset(imap_dirty, 0, (imap_blocks + 7) / 8);
+	memset(dmap_dirty, 0, (dmap_blocks + 7) / 8);
+	bitmaps_count();
+}
+
+// Held across bitmaps_store(), see there
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Write the bitmap blocks changed since the last call through the block
+ * cache, so the journal sees them, and the free counts with the superblock
+ * when they moved. Each block is copied under alloc_lock and written
+ * without it; an allocation after the copy marks the block dirty again.
+ * store_lock keeps two callers, such as fsyncs of different files, from
+ * writing their copies out of order, which could leave an older copy in
+ * the cache with the dirty bit already clear.
+ * Unless runs is NULL the blocks written are appended to it, and -1 is
+ * returned if they need more than max runs.
+ */
+static int bitmaps_store(struct bio_run *runs, int *n, int max) {
+	int ret = 0;
+	int ipg = my_super_block->inodes_per_group;
+
+	pthread_mutex_lock(&store_lock);
+	pthread_mutex_lock(&alloc_lock);
+	for(int i=0; i<imap_blocks; i++){
+		if(!get_bitmap(imap_dirty, i))
+			continue;
+		unset_bitmap(imap_dirty, i);
+		memset(data_blk, 0, BLOCK_SIZE);
+		if(GROUPED)
+			memcpy(data_blk, inode_bitmap + i*(ipg/8), ipg/8);
+		else
+			memcpy(data_blk, inode_bitmap + i*BLOCK_SIZE, BLOCK_SIZE);
+		pthread_mutex_unlock(&alloc_lock);
+		int blk_num = (GROUPED ? group_start(i) : i) + my_super_block->i_bitmap_blk;
+		bio_write(blk_num, data_blk);
+		if(runs != NULL && add_run(runs, n, max, blk_num, 1) < 0)
+			ret = -1;
+		pthread_mutex_lock(&alloc_lock);
 	}
-	
-	memset(data_blk3, 0, BLOCK_SIZE);
-	bio_read(final_blk_num, data_blk3);
-	last_dirent_addr = data_blk3 + offset;
-	
-	memcpy(dirent_rem_addr, last_dirent_addr, sizeof(struct dirent));
+	for(int i=0; i<dmap_blocks; i++){
+		if(!get_bitmap(dmap_dirty, i))
+			continue;
+		unset_bitmap(dmap_dirty, i);
+		memcpy(data_blk, data_bitmap + i*BLOCK_SIZE, BLOCK_SIZE);
+		for(int j=0; (pa_blocks > 0 || pending_blocks > 0) && j<BLOCK_SIZE; j++)
+			((unsigned char *)data_blk)[j] &= ~(pa_bitmap[i*BLOCK_SIZE + j] | free_pending[i*BLOCK_SIZE + j]);
+		pthread_mutex_unlock(&alloc_lock);
+		int blk_num = (GROUPED ? group_start(i) : i) + my_super_block->d_bitmap_blk;
+		bio_write(blk_num, data_blk);
+		if(runs != NULL && add_run(runs, n, max, blk_num, 1) < 0)
+			ret = -1;
+		pthread_mutex_lock(&alloc_lock);
+	}
+	// Window and pending blocks are free on disk, so they count as free there too
+	if(my_super_block->free_blocks_count == (uint32_t)(num_free_blocks + pa_blocks + pending_blocks) &&
+	   my_super_block->free_inodes_count == (uint32_t)num_free_inodes){
+		pthread_mutex_unlock(&alloc_lock);
+		pthread_mutex_unlock(&store_lock);
+		return ret;
+	}
+	my_super_block->free_blocks_count = num_free_blocks + pa_blocks + pending_blocks;
+	my_super_block->free_inodes_count = num_free_inodes;
+	memset(data_blk, 0, BLOCK_SIZE);
+	memcpy(data_blk, my_super_block, sizeof(struct superblock));
+	pthread_mutex_unlock(&alloc_lock);
+	bio_write(0, data_blk);
+	pthread_mutex_unlock(&store_lock);
+	if(runs != NULL && add_run(runs, n, max, 0, 1) < 0)
+		ret = -1;
+	return ret;
+}
 
-	memset(last_dirent_addr, 0, sizeof(struct dirent));
-	bio_write(dirent_rem_blk, data_blk);
-	if(dirent_rem_blk != final_blk_num)
-		bio_write(final_blk_num, data_blk3);
-	if(offset == 0 && num_dirents == 1){
-		if(d_blk_num < 16){
-			unset_bitmap(data_bitmap, final_blk_num - my_super_block->d_start_blk);
-			dir_inode.direct_ptr[d_blk_num] = -1;
-		}
-		else{
-			unset_bitmap(data_bitmap, final_blk_num - my_super_block->d_start_blk);
-			memset(data_blk3+ind_blk_offset, -1, sizeof(int));
-			bio_write(dir_inode.indirect_ptr[ind_blk_num], data_blk3);
-			if(ind_blk_offset == 0){
-				unset_bitmap(data_bitmap, dir_inode.indirect_ptr[ind_blk_num] - my_super_block->d_start_blk);
-				dir_inode.indirect_ptr[ind_blk_num] = -1;
+/*
+ * Write back the data of the blocks allocated since the last call, a
+ * batch of ORDERED_RUNS runs at a time. Metadata blocks among them are
+ * held and left alone.
+ */
+#define ORDERED_RUNS 256
+
+static void ordered_flush() {
+	static struct bio_run runs[ORDERED_RUNS];	/* only the committing thread gets here */
+	int n = 0;
+
+	pthread_mutex_lock(&alloc_lock);
+	for(int i=0; i<dmap_blocks; i++){
+		if(!get_bitmap(ordered_map, i))
+			continue;
+		unset_bitmap(ordered_map, i);
+		for(int w=i*(BLOCK_SIZE/8); w<(i+1)*(BLOCK_SIZE/8); w++){
+			uint64_t bits = get_bitmap_word(ordered_bitmap, w);
+			if(bits == 0)
+				continue;
+			memset(ordered_bitmap + w*8, 0, 8);
+			while(bits != 0){
+				int blk_num = dmap_base + w*64 + __builtin_ctzll(bits);
+				bits &= bits - 1;
+				if(n > 0 && runs[n-1].start + runs[n-1].len == blk_num){
+					runs[n-1].len++;
+					continue;
+				}
+				if(n == ORDERED_RUNS){
+					pthread_mutex_unlock(&alloc_lock);
+					bio_flush_runs(runs, n);
+					pthread_mutex_lock(&alloc_lock);
+					n = 0;
+				}
+				runs[n].start = blk_num;
+				runs[n].len = 1;
+				n++;
 			}
 		}
 	}
+	pthread_mutex_unlock(&alloc_lock);
+	if(n > 0)
+		bio_flush_runs(runs, n);
+}
 
-	time_t current_time = time(NULL);
-	dir_inode.vstat.st_atime = current_time;
-
-	writei(dir_inode.ino, &dir_inode);
-	
-	return 0;
+// Called by a journal commit: dirty inodes and the bitmaps go to the block
+// cache, and the data of new blocks to the disk
+static void journal_prepare() {
+	iflush(0);
+	bitmaps_store(NULL, NULL, 0);
+	ordered_flush();
 }
 
-/* 
- * namei operation
+/*
+ * Rewrite the inode tables of an image with struct dinode_v1 inodes as
+ * struct dinode (-o migrate_inodes). New table block j gets the inodes of
+ * old blocks 2j and 2j+1, so going up from block 0 never overwrites an old
+ * block before it has been converted. The blocks freed at the end of each
+ * table stay unused. A crash midway leaves a mixed table behind.
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	if(debugOuter)
-		printf("\n---> ENTERING get_node_by_path to find node for %s", path);
-	size_t length = strlen(path);
-	if(path[0] == '/' && length == 1){
-		if(debugInner)
-			printf("\n     -> Returned root inode");
-		readi(ino, inode);
-		if(debugOuter)
-			printf("\n---> EXITING from get node by path with status SUCCESS\n");
-		return 0;
-	}
-	const char *fname;
-	int str_index;
-	fname = path+1; 
-	str_index = 1; 
-	length--;
-	struct dirent entry;
-	int name_len = 1;
-	while(length > 0){
-		if(path[str_index] == '/' || length == 1){
-			name_len = (length == 1) ? name_len : name_len - 1;
-			if(dir_find(ino, fname, name_len, &entry)<0){
-				if(debugInner)
-					printf("\n     -> Entry not found for %s", fname);
-				if(debugOuter)
-					printf("\n---> EXITING from get_node_by_path with status FAILURE\n");
-				return -1;
-			}
-			if(length == 1){
-				readi(entry.ino, inode);
-				if(debugInner)
-					printf("\n     -> Inode for %s is %d\n", fname, inode->ino);
-				break;
+static void inodes_migrate() {
+	int tables = GROUPED ? groups_count : 1;
+	int per_table = GROUPED ? my_super_block->inodes_per_group : my_super_block->inodes_count;
+	int old_per_blk = BLOCK_SIZE / sizeof(struct dinode_v1);
+	int new_per_blk = BLOCK_SIZE / sizeof(struct dinode);
+	struct inode inode;
+
+	for(int t=0; t<tables; t++){
+		int start = (GROUPED ? group_start(t) : 0) + my_super_block->i_start_blk;
+		int old_blocks = (per_table + old_per_blk - 1) / old_per_blk;
+		for(int j=0; j*new_per_blk < per_table; j++){
+			memset(data_blk2, 0, BLOCK_SIZE);
+			for(int k=0; k<new_per_blk/old_per_blk && j*2 + k < old_blocks; k++){
+				bio_read(start + j*2 + k, data_blk);
+				for(int i=0; i<old_per_blk; i++){
+					uint32_t ino = t*per_table + (j*2 + k)*old_per_blk + i;
+					dinode_load_v1(&inode, data_blk + i*sizeof(struct dinode_v1), ino);
+					dinode_store_v2(data_blk2 + (k*old_per_blk + i)*sizeof(struct dinode), &inode);
+				}
 			}
-			ino = entry.ino;
-			fname += name_len+1;
-			name_len = 1;
+			bio_write(start + j, data_blk2);
 		}
-		else
-			name_len++;
-		str_index++;
-		length--;
 	}
-	if(debugOuter)
-		printf("\n---> EXITING from get node by path with status SUCCESS\n");
-	return 0;
+	// An image with the original magic has no feature flags; it takes the
+	// newer magic so that the flag survives the next mount
+	my_super_block->magic_num = MAGIC_NUM_FEAT;
+	my_super_block->features = (my_super_block->features & SB_FEAT_ALL) | SB_FEAT_COMPACT_INODE;
+	inode_size = sizeof(struct dinode);
+	memset(data_blk, 0, BLOCK_SIZE);
+	memcpy(data_blk, my_super_block, sizeof(struct superblock));
+	bio_write(0, data_blk);
+	bio_flush();
 }
 
 /* 
@@ -598,54 +3147,128 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
  */
 int rufs_mkfs() {
 
-	// Call dev_init() to initialize (Create) Diskfile
+	// Step 1: Work out the geometry, the default one unless -o size/inodes
+	// were given. Fixed dirents only hold 16-bit inode numbers.
 	if(debugOuter)
 		printf("\n ---> ENTERING rufs_mkfs");
-	dev_init(diskfile_path);
+	uint64_t blocks_count = MAX_DNUM;
+	uint64_t inodes_count = MAX_INUM;
+	if(rufs_opts.size > 0){
+		blocks_count = ((uint64_t)rufs_opts.size << 20) / BLOCK_SIZE;
+		inodes_count = blocks_count / 16;
+	}
+	if(rufs_opts.inodes > 0)
+		inodes_count = rufs_opts.inodes;
+	if(rufs_opts.fixed_dirents && inodes_count > 65536)
+		inodes_count = 65536;
+	if(blocks_count > INT_MAX)
+		blocks_count = INT_MAX;
+	inode_size = (rufs_opts.inode_size == sizeof(struct dinode_large)) ? sizeof(struct dinode_large) : sizeof(struct dinode);
+
+	// Flat layout: superblock, inode bitmap, data block bitmap, inode table,
+	// data blocks. With block groups every group has one block of each
+	// bitmap and its share of the inodes, the group size being what one
+	// data bitmap block maps.
+	int bits_per_blk = BLOCK_SIZE * 8;
+	int groups = 0, ipg = 0;
+	int i_bitmap_blocks = 1, d_bitmap_blocks = 1;
+	uint64_t i_table_blocks, room = blocks_count;
+	if(!rufs_opts.nogroups){
+		groups = (blocks_count + bits_per_blk - 1) / bits_per_blk;
+		ipg = (inodes_count + groups - 1) / groups;
+		ipg = (ipg + 63) / 64 * 64;
+		if(rufs_opts.fixed_dirents && (uint64_t)ipg * groups > 65536)
+			ipg = 65536 / groups / 64 * 64;
+		if(ipg > bits_per_blk)
+			ipg = bits_per_blk;
+		i_table_blocks = ipg / INODES_PER_BLK;
+		// A last group too small for its own metadata is left out
+		if(groups > 1 && blocks_count - (uint64_t)(groups - 1) * bits_per_blk <= 3 + i_table_blocks){
+			groups--;
+			blocks_count = (uint64_t)groups * bits_per_blk;
+		}
+		inodes_count = (uint64_t)groups * ipg;
+		if(room > bits_per_blk)
+			room = bits_per_blk;
+	}
+	else{
+		inodes_count = (inodes_count + INODES_PER_BLK - 1) / INODES_PER_BLK * INODES_PER_BLK;
+		i_bitmap_blocks = (inodes_count + bits_per_blk - 1) / bits_per_blk;
+		d_bitmap_blocks = (blocks_count + bits_per_blk - 1) / bits_per_blk;
+		i_table_blocks = inodes_count / INODES_PER_BLK;
+	}
+	if(inodes_count == 0 || 1 + i_bitmap_blocks + d_bitmap_blocks + i_table_blocks >= room){
+		fprintf(stderr, "rufs: %lu blocks leave no room for data after %lu inodes\n",
+				(unsigned long)blocks_count, (unsigned long)inodes_count);
+		exit(EXIT_FAILURE);
+	}
+
+	// Step 2: Call dev_init() to initialize (Create) Diskfile
+	dev_init(diskfile_path, (off_t)blocks_count * BLOCK_SIZE);
 	if(dev_open(diskfile_path) == 0){
-		data_blk = malloc(BLOCK_SIZE);
+		bio_cache_init(rufs_opts.cache_blocks);
 		
-		my_super_block = malloc(sizeof(struct superblock));
+		my_super_block = calloc(1, sizeof(struct superblock));
 		
 		// write superblock information
 		my_super_block->i_bitmap_blk = 1;
-		my_super_block->d_bitmap_blk = 2;
-		my_super_block->max_inum = MAX_INUM;
-		my_super_block->max_dnum = MAX_DNUM;
-		my_super_block->i_start_blk = 3;
-		my_super_block->magic_num = MAGIC_NUM;
-		my_super_block->d_start_blk = my_super_block->i_start_blk + (MAX_INUM * sizeof(struct inode) ) / BLOCK_SIZE;
-		
-		memset(data_blk, 0, BLOCK_SIZE);
-		memcpy(data_blk, my_super_block, sizeof(struct superblock));
-		bio_write(0, my_super_block);
+		my_super_block->d_bitmap_blk = my_super_block->i_bitmap_blk + i_bitmap_blocks;
+		my_super_block->i_start_blk = my_super_block->d_bitmap_blk + d_bitmap_blocks;
+		my_super_block->d_start_blk = my_super_block->i_start_blk + i_table_blocks;
+		my_super_block->max_inum = (inodes_count > UINT16_MAX) ? UINT16_MAX : inodes_count;
+		my_super_block->max_dnum = (blocks_count > UINT16_MAX) ? UINT16_MAX : blocks_count;
+		my_super_block->block_size = BLOCK_SIZE;
+		my_super_block->inodes_count = inodes_count;
+		my_super_block->blocks_count = blocks_count;
+		my_super_block->magic_num = MAGIC_NUM_FEAT;
+		my_super_block->features = SB_FEAT_GEOMETRY;
+		if(!rufs_opts.fixed_dirents)
+			my_super_block->features |= SB_FEAT_VAR_DIRENT;
+		if(!rufs_opts.noextents)
+			my_super_block->features |= SB_FEAT_EXTENTS;
+		if(!rufs_opts.noinline)
+			my_super_block->features |= SB_FEAT_INLINE_DATA;
+		my_super_block->features |= SB_FEAT_COMPACT_INODE;
+		if(inode_size == sizeof(struct dinode_large))
+			my_super_block->features |= SB_FEAT_LARGE_INODE;
+		if(groups > 0){
+			my_super_block->features |= SB_FEAT_GROUPS;
+			my_super_block->blocks_per_group = bits_per_blk;
+			my_super_block->inodes_per_group = ipg;
+		}
 		
-
-		// initialize inode bitmap
-		num_free_blocks = (MAX_INUM * sizeof(struct inode) ) / BLOCK_SIZE;
-		inode_bitmap_len = ((BLOCK_SIZE/sizeof(struct inode))*num_free_blocks)/8;    //1 Byte = 8 bits, so divide by 8
-		inode_bitmap = malloc(inode_bitmap_len);
-		int inode_bitmap_arr_len = inode_bitmap_len;
-		while(inode_bitmap_arr_len > 0){
-			inode_bitmap[inode_bitmap_arr_len - 1] = 0;
-			inode_bitmap_arr_len--;
+		// initialize inode bitmap and data block bitmap, everything is free
+		// but the metadata blocks of each group
+		bitmaps_alloc();
+		for(int g=0; g<groups; g++){
+			for(int i=0; i<my_super_block->d_start_blk; i++)
+				set_bitmap(data_bitmap, group_start(g) + i);
+			group_free_inodes[g] = ipg;
 		}
-		memset(data_blk, 0, BLOCK_SIZE);
-		memcpy(data_blk, inode_bitmap, inode_bitmap_len);
-		bio_write(1, data_blk);
-
-		// initialize data block bitmap
-		num_free_blocks = MAX_DNUM - num_free_blocks - 3;
-		data_bitmap_len = num_free_blocks/8;    //1 Byte = 8 bits, so divide by 8
-		data_bitmap = malloc(data_bitmap_len);
-		int data_bitmap_arr_len = data_bitmap_len;
-		while(data_bitmap_arr_len > 0){
-			data_bitmap[data_bitmap_arr_len - 1] = 0;
-			data_bitmap_arr_len--;
+		bitmaps_count();
+
+		// The journal takes one contiguous run at the start of the data blocks
+		if(rufs_opts.journal > 0){
+			int got;
+			int j_blk = get_avail_blkno_run(my_super_block->d_start_blk, rufs_opts.journal, 0, &got);
+			if(j_blk != -1 && got == rufs_opts.journal && journal_format(j_blk, got) == 0){
+				my_super_block->features |= SB_FEAT_JOURNAL;
+				my_super_block->journal_blk = j_blk;
+				my_super_block->journal_blocks = got;
+			}
+			else{
+				fprintf(stderr, "rufs: cannot make a %d block journal, making the file system without one\n", rufs_opts.journal);
+				if(j_blk != -1)
+					release_blkno_run(j_blk, got);
+			}
 		}
+
+		// Every group starts with a copy of the superblock
 		memset(data_blk, 0, BLOCK_SIZE);
-		memcpy(data_blk, data_bitmap, data_bitmap_len);
-		bio_write(2, data_blk);
+		memcpy(data_blk, my_super_block, sizeof(struct superblock));
+		bio_write(0, data_blk);
+		for(int g=1; g<groups; g++)
+			bio_write(group_start(g), data_blk);
 		
 		// update bitmap information for root directory
 		int r_inode_bit = get_avail_ino();
@@ -657,32 +3280,25 @@ int rufs_mkfs() {
 		root_inode.ino = r_inode_bit;
 		root_inode.size = 0;		// Update size when writing to file's data block
 		root_inode.valid = 1;
-		root_inode.type = __S_IFDIR;
+		root_inode.flags = 0;
+		root_inode.type = __S_IFDIR | 0755;  // Directory with permissions 0755
 		root_inode.link = 2;
-		root_inode.vstat.st_dev = 0;
-		root_inode.vstat.st_ino = root_inode.ino;
-		root_inode.vstat.st_mode = __S_IFDIR | 0755;  // Directory with permissions 0755
-		root_inode.vstat.st_nlink = root_inode.link;
-		root_inode.vstat.st_uid = getuid();
-		root_inode.vstat.st_gid = getgid();
-		root_inode.vstat.st_rdev = 0;
-		root_inode.vstat.st_size = root_inode.size;
-		root_inode.vstat.st_blksize = BLOCK_SIZE;
-		root_inode.vstat.st_blocks = 0;
+		root_inode.uid = getuid();
+		root_inode.gid = getgid();
 		
-		time_t current_time = time(NULL);
-		root_inode.vstat.st_atime = current_time;
-		root_inode.vstat.st_mtime = current_time;
-		root_inode.vstat.st_blocks = 0;
+		clock_gettime(CLOCK_REALTIME, &root_inode.atime);
+		root_inode.mtime = root_inode.atime;
+		root_inode.ctime = root_inode.atime;
 
-		for(int i=0; i<16; i++)
-			root_inode.direct_ptr[i] = -1;
-		for(int i=0; i<8; i++)
-			root_inode.indirect_ptr[i] = -1;
+		init_blkmap(&root_inode);
 
 		memset(data_blk, 0, BLOCK_SIZE);
-		memcpy(data_blk, &root_inode, sizeof(struct inode));
-		bio_write(my_super_block->i_start_blk, data_blk);
+		dinode_store(data_blk, &root_inode);
+		bio_write(inode_blkno(r_inode_bit), data_blk);
+
+		// The new file system is on disk before anything is journaled
+		bitmaps_store(NULL, NULL, 0);
+		bio_sync();
 		if(debugOuter)
 			printf("\n---> EXITING rufs_mkfs\n");
 	}
@@ -702,19 +3318,49 @@ static void *rufs_init(struct fuse_conn_info *conn) {
 	if(dev_open(diskfile_path) == -1)
 		rufs_mkfs();
 	else{
+		bio_cache_init(rufs_opts.cache_blocks);
 		my_super_block = malloc(sizeof(struct superblock));
-		data_blk = malloc(BLOCK_SIZE);
 		bio_read(0, data_blk);
 		memcpy(my_super_block, data_blk, sizeof(struct superblock));
-		inode_bitmap = malloc(BLOCK_SIZE);
-		bio_read(1, (void*)inode_bitmap);
-		data_bitmap = malloc(BLOCK_SIZE);
-		bio_read(2, (void*)data_bitmap);
+		if(my_super_block->magic_num != MAGIC_NUM_FEAT)
+			my_super_block->features = 0;
+		if(!(my_super_block->features & SB_FEAT_GEOMETRY)){
+			my_super_block->block_size = BLOCK_SIZE;
+			my_super_block->inodes_count = my_super_block->max_inum;
+			my_super_block->blocks_count = my_super_block->max_dnum;
+		}
+		if(my_super_block->block_size != BLOCK_SIZE){
+			fprintf(stderr, "rufs: image uses %u byte blocks, not %d\n", my_super_block->block_size, BLOCK_SIZE);
+			exit(EXIT_FAILURE);
+		}
+
+		// Finish what the journal committed before the rest of the metadata is read
+		if((my_super_block->features & SB_FEAT_JOURNAL) &&
+		   journal_recover(my_super_block->journal_blk, my_super_block->journal_blocks) > 0){
+			bio_read(0, data_blk);
+			memcpy(my_super_block, data_blk, sizeof(struct superblock));
+		}
+		bitmaps_alloc();
+		bitmaps_load();
+		inode_size = dinode_size();
+		if(rufs_opts.migrate_inodes && !(my_super_block->features & SB_FEAT_COMPACT_INODE))
+			inodes_migrate();
 	}
+	if(rufs_opts.io_uring && bio_uring_init() < 0)
+		fprintf(stderr, "rufs: io_uring not available, using pread/pwrite\n");
+	if(rufs_opts.mmap && bio_mmap_init() < 0)
+		fprintf(stderr, "rufs: cannot map the disk image, using the block cache\n");
+
 	// Step 1b: If disk file is found, just initialize in-memory data structures
 	// and read superblock from disk
-	data_blk2 = malloc(BLOCK_SIZE);
-	data_blk3 = malloc(BLOCK_SIZE);
+	icache_init(rufs_opts.inode_cache);
+	dcache_init(rufs_opts.dentry_cache);
+	if(my_super_block->features & SB_FEAT_JOURNAL){
+		if(journal_open(rufs_opts.commit, journal_prepare, free_commit) < 0)
+			fprintf(stderr, "rufs: journaling needs the block cache, mounted without it\n");
+		else
+			journaling = 1;
+	}
 	if(debugOuter)
 		printf("\n---> EXITING rufs_init\n");
 	return NULL;
@@ -722,31 +3368,40 @@ static void *rufs_init(struct fuse_conn_info *conn) {
 
 static void rufs_destroy(void *userdata) {
 
-	// Step 1: De-allocate in-memory data structures
-	bio_write(0, (void*)my_super_block);
-	bio_write(1, (void*)inode_bitmap);
-	bio_write(2, (void*)data_bitmap);
-
-	bio_read(my_super_block->d_bitmap_blk, data_bitmap);
-    int numBlocksUsed = 0;
-    for(int i = 0; i < MAX_DNUM; i++)
-    {
-        if(get_bitmap(data_bitmap, i) == 1)
-        {
-            numBlocksUsed++;
-        }
-    }
-	//Printing Total Blocks used excluding the superblock Block, data_bitmap Block, and inode_bitmap Block
-    printf("Num blocks used: %d\n",numBlocksUsed - 3);
+	// Step 1: Write back cached inodes, commit them and de-allocate in-memory
+	// data structures
+	iflush(1);
+	journal_close();
+	journaling = 0;
+	icache_free();
+	dcache_free();
+	memset(data_blk, 0, BLOCK_SIZE);
+	memcpy(data_blk, my_super_block, sizeof(struct superblock));
+	bio_write(0, data_blk);
+	bitmaps_store(NULL, NULL, 0);
+
+	//Printing the data blocks used, the superblock, bitmaps, inode tables and journal left out
+    printf("Num blocks used: %d\n",get_blocks_used());
+
+	unsigned long hits, misses;
+	bio_cache_stats(&hits, &misses);
+	printf("Block cache: %lu hits, %lu misses\n", hits, misses);
+	printf("Dentry cache: %lu hits, %lu misses\n", dcache_hits, dcache_misses);
 
 	free(my_super_block);
-	free(data_blk);
-	free(data_blk2);
-	free(data_blk3);
 	free(inode_bitmap);
 	free(data_bitmap);
-
-	// Step 2: Close diskfile
+	free(pa_bitmap);
+	free(free_pending);
+	free(pend_map);
+	free(ordered_bitmap);
+	free(ordered_map);
+	free(group_free_inodes);
+	free(imap_dirty);
+	free(dmap_dirty);
+	group_free_inodes = NULL;
+
+	// Step 2: Write back the block cache and close diskfile
 	dev_close(diskfile_path);
 	if(debugOuter)
 		printf("\n---> EXITING rufs_destroy\n");
@@ -767,7 +3422,7 @@ static int rufs_getattr(const char *path, struct stat *stbuf) {
 		printf("\n     -> Final Inode's # returned from get_node is %d", final_inode.ino);
     // Step 2: fill attribute of file into stbuf from inode
     // Set mode
-	stbuf->st_mode = final_inode.vstat.st_mode;
+	stbuf->st_mode = final_inode.type;
 
     // Set number of hard links.
     stbuf->st_nlink = final_inode.link;
@@ -776,12 +3431,16 @@ static int rufs_getattr(const char *path, struct stat *stbuf) {
     stbuf->st_size = final_inode.size;
 
     // Set uid and gid
-    stbuf->st_uid = final_inode.vstat.st_uid;
-    stbuf->st_gid = final_inode.vstat.st_gid;
+    stbuf->st_uid = final_inode.uid;
+    stbuf->st_gid = final_inode.gid;
 
     // Set the time fields
-    stbuf->st_atime = final_inode.vstat.st_atime; // Access time
-    stbuf->st_mtime = final_inode.vstat.st_mtime; // Modification time
+    stbuf->st_atim = final_inode.atime; // Access time
+    stbuf->st_mtim = final_inode.mtime; // Modification time
+    stbuf->st_ctim = final_inode.ctime; // Change time
+
+    stbuf->st_ino = final_inode.ino;
+    stbuf->st_blksize = BLOCK_SIZE;
     
 	if (S_ISDIR(stbuf->st_mode)) {
         stbuf->st_mode |= __S_IFDIR;
@@ -807,99 +3466,54 @@ static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
 	}
 
 	if(debugOuter)
-		printf("\n---> Exiting the rufs_opendir with status SUCCESS\n");
-    return 0;
-}
-
-static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-
-	// Step 1: Call get_node_by_path() to get inode from path
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode dir_inode;
-	if(debugOuter)
-		printf("\n---> ENTERING rufs_readdir");
-	get_node_by_path(path, 0, &dir_inode);
-
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	int d_blk_num = 0;	
-	int size_read = 0;
-	int num_dirents = dir_inode.size/sizeof(struct dirent);
-	if(debugInner)
-		printf("\n     -> Num Dirents in parent_dir ino # %d is %d", dir_inode.ino, num_dirents);
-	
-	while(dir_inode.direct_ptr[d_blk_num] != -1 && d_blk_num < 16 && size_read < dir_inode.size){
-
-		int num_dirents_blk = (num_dirents > (BLOCK_SIZE/sizeof(struct dirent))) ? (BLOCK_SIZE/sizeof(struct dirent)) : num_dirents;
-		if(debugInner){
-			printf("\n     -> Direct\n     -> Num Dirents in block # %d is %d", dir_inode.direct_ptr[d_blk_num], num_dirents_blk);
-			fflush(stdout);
-		}
-		memset(data_blk, 0, BLOCK_SIZE);
-		bio_read(dir_inode.direct_ptr[d_blk_num], data_blk);
-		struct dirent *dirents = data_blk;
-		for(int i=0; i<num_dirents_blk; i++){
-			char temp_name[208];
-			int name_len = strlen(dirents[i].name);
-			strncpy(temp_name, dirents[i].name, name_len);
-			temp_name[name_len] = '\0';
-			if(filler(buffer, temp_name, NULL, offset) != 0){
-				return -ENOMEM;
-			}
-		}
-		num_dirents -= num_dirents_blk;
-		size_read += num_dirents_blk*sizeof(struct dirent);
-		d_blk_num++;
-	}
-	while(d_blk_num >= 16 && dir_inode.indirect_ptr[d_blk_num-16] != -1 && size_read < dir_inode.size){
-		memset(data_blk, 0, BLOCK_SIZE);
-		if(bio_read(dir_inode.indirect_ptr[d_blk_num-16], data_blk) < 0){
-			if(debugOuter)
-				printf("\n---> EXITING readdir with status FAILURE\n");
-			debugInner = 0;
-			debugOuter = 0;
-			return -EIO;
-		}
-		int *ind_blk_nums = (int *)data_blk;
-		int k = 0;
-		while(d_blk_num >= 16 && size_read < dir_inode.size){
-		int num_dirents_blk = (num_dirents > (BLOCK_SIZE/sizeof(struct dirent))) ? (BLOCK_SIZE/sizeof(struct dirent)) : num_dirents;
-		if(debugInner)
-			printf("\n     -> Num Dirents in block # %d is %d", ind_blk_nums[k], num_dirents_blk);
-		memset(data_blk2, 0, BLOCK_SIZE);
-		if(bio_read(ind_blk_nums[k], data_blk2) < 0){
-			if(debugOuter)
-				printf("\n---> EXITING readdir with status FAILURE\n");
-			debugInner = 0;
-			debugOuter = 0;
-			return -EIO;
-		}
-
-		struct dirent *dirents = data_blk2;
-		for(int i=0; i<num_dirents_blk; i++){
-			char temp_name[208];
-			strncpy(temp_name, dirents[i].name, dirents[i].len);
-			temp_name[dirents[i].len] = '\0';
-			if(filler(buffer, temp_name, NULL, offset) != 0)
-			{
-				debugInner = 0;
-				debugOuter = 0;
-				return -ENOMEM;
-			}				
-		}
-		num_dirents -= num_dirents_blk;
-		size_read += num_dirents_blk*sizeof(struct dirent);
-		k++;
-	}
-	d_blk_num++;
-	}
-	printf("\n     -> SegFault Here 1");
-	fflush(stdout);
-
-	if(debugOuter)
-		printf("\n---> Exiting the rufs_readdir with status SUCCESS\n");
+		printf("\n---> Exiting the rufs_opendir with status SUCCESS\n");
+    return 0;
+}
+
+struct readdir_ctx {
+	void *buffer;
+	fuse_fill_dir_t filler;
+	off_t offset;
+};
+
+static int readdir_fill(void *arg, const struct dirent *dirent) {
+	struct readdir_ctx *ctx = arg;
+	char temp_name[208];
+	strncpy(temp_name, dirent->name, dirent->len);
+	temp_name[dirent->len] = '\0';
+	if(ctx->filler(ctx->buffer, temp_name, NULL, ctx->offset) != 0)
+		return -ENOMEM;
 	return 0;
 }
 
+static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+
+	// Step 1: Call get_ino_by_path() and iget() to get inode from path
+	uint32_t ino;
+	if(debugOuter)
+		printf("\n---> ENTERING rufs_readdir");
+	if(get_ino_by_path(path, 0, &ino) < 0)
+		return -ENOENT;
+	struct inode *dir_inode = iget(ino);
+	if(dir_inode == NULL)
+		return -EIO;
+
+	// Step 2: Read directory entries from its data blocks, and copy them to filler
+	struct readdir_ctx ctx = { buffer, filler, offset };
+	if(debugInner)
+		printf("\n     -> Num Dirents in parent_dir ino # %d is %d", dir_inode->ino, (int)(dir_inode->size/sizeof(struct fdirent)));
+	irlock(dir_inode);
+	int ret = dir_iterate(dir_inode, readdir_fill, &ctx);
+	if(ret == 0)
+		iaccessed(dir_inode);
+	iunlock(dir_inode);
+	iput(dir_inode);
+
+	if(debugOuter)
+		printf("\n---> Exiting the rufs_readdir with status %s\n", ret == 0 ? "SUCCESS" : "FAILURE");
+	return ret;
+}
+
 int dir_base_split(const char *path, char *dir_name, char *base_name){
 
 	int length = strlen(path);
@@ -912,12 +3526,12 @@ int dir_base_split(const char *path, char *dir_name, char *base_name){
     }
 
     // Copy the base name and null-terminate it
-    strncpy(base_name, path + length, basename_len);
+    memcpy(base_name, path + length, basename_len);
     base_name[basename_len] = '\0';
 
     // Copy the directory name and null-terminate it
     if (length > 1) { // if path is more than just "/"
-        strncpy(dir_name, path, length - 1);
+        memcpy(dir_name, path, length - 1);
         dir_name[length - 1] = '\0';
     } else {
         // strncpy(dir_name, "/", 1); // root directory
@@ -945,11 +3559,12 @@ static int rufs_mkdir(const char *path, mode_t mode) {
 		printf("\nTarget File: %s", base_name);
 	}
 
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode dir_inode;
+	// Step 2: Call get_ino_by_path() and iget() to get inode of parent directory
+	uint32_t dir_ino;
+	struct inode *dir_inode;
 	if(debugInner)
-		printf("     -> going to call get_node_by_path in mkdir\n");
-	if(get_node_by_path(dir_name, 0, &dir_inode)<0){
+		printf("     -> going to call get_ino_by_path in mkdir\n");
+	if(get_ino_by_path(dir_name, 0, &dir_ino)<0 || (dir_inode = iget(dir_ino)) == NULL){
 		if(debugOuter)
 			printf("\n---> Exiting the rufs_mkdir with status FAILURE\n");
 		free(base_name);
@@ -957,70 +3572,70 @@ static int rufs_mkdir(const char *path, mode_t mode) {
 		return -ENOENT;
 	}
 	if(debugInner)
-		printf("\n     -> Dir Inode's Ino # is %d", dir_inode.ino);
+		printf("\n     -> Dir Inode's Ino # is %d", dir_inode->ino);
 	
 	struct dirent entry;
-	if(dir_inode.direct_ptr[0] != -1 && dir_find(dir_inode.ino, base_name, strlen(base_name), &entry) == 0){
+	if(dir_find(dir_inode->ino, base_name, strlen(base_name), &entry) == 0){
 		if(debugInner)
 			printf("\n     -> Directory/File with name %s already exists", base_name);
 		if(debugOuter)
-				printf("\n---> EXITING dir_add with status FAILURE\n");
+				printf("\n---> EXITING rufs_mkdir with status FAILURE\n");
+		iput(dir_inode);
+		free(base_name);
+		free(dir_name);
 		return -EEXIST;
 	}
 
 	if(debugInner)
 		printf("     -> going to call get_avail_ino in mkdir\n");
 	
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int ino = get_avail_ino();
+	// Step 3: Call get_avail_ino_near() to get an available inode number
+	int ino = get_avail_ino_near(ialloc_goal(dir_inode, 1));
 	if(ino == -1){
-		return -ENOMEM;
+		iput(dir_inode);
+		free(base_name);
+		free(dir_name);
+		return -ENOSPC;
 	}
 	if(debugInner)
 		printf("\n     ->New inode #: %d", ino);
 
+	// Step 4: Set up the new inode and call writei() before the name is
+	// added, so a lookup that finds the name never reads a stale inode
+	struct inode f_inode;
+	f_inode.ino = ino;
+	f_inode.size = 0;		// Update size when writing to file's data block
+	f_inode.valid = 1;
+	f_inode.flags = 0;
+	f_inode.type = __S_IFDIR | (mode & 0777);
+	f_inode.link = 2;
+	f_inode.uid = getuid();
+	f_inode.gid = getgid();
+	
+	clock_gettime(CLOCK_REALTIME, &f_inode.atime);
+	f_inode.mtime = f_inode.atime;
+	f_inode.ctime = f_inode.atime;
+
+	init_blkmap(&f_inode);
+	writei(ino, &f_inode);
+
 	if(debugInner)
 		printf(" \n     -> going to call dir_add in mkdir\n");
 	
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
+	// Step 5: Call dir_add() to add directory entry of target directory to parent directory
 	int ret = dir_add(dir_inode, ino, base_name, strlen(base_name));
+	iput(dir_inode);
 	if(ret < 0)
 	{
 		if(debugOuter)
 			printf("\n---> Exiting the rufs_mkdir with status FAILURE\n");
+		f_inode.valid = 0;
+		writei(ino, &f_inode);
+		release_ino(ino);
 		free(base_name);
 		free(dir_name);
 		return ret;
 	}
-
-	struct inode f_inode;
-	f_inode.ino = ino;
-	f_inode.size = 0;		// Update size when writing to file's data block
-	f_inode.valid = 1;
-	f_inode.type = __S_IFDIR | (mode & 0777);
-	f_inode.link = 2;
-	f_inode.vstat.st_dev = 0;
-	f_inode.vstat.st_ino = f_inode.ino;
-	f_inode.vstat.st_mode = f_inode.type;  // Directory with permissions as provided
-	f_inode.vstat.st_nlink = f_inode.link;
-	f_inode.vstat.st_uid = getuid();
-	f_inode.vstat.st_gid = getgid();
-	f_inode.vstat.st_rdev = 0;
-	f_inode.vstat.st_size = f_inode.size;
-	f_inode.vstat.st_blksize = BLOCK_SIZE;
-	f_inode.vstat.st_blocks = 0;
-	
-	time_t current_time = time(NULL);
-	f_inode.vstat.st_atime = current_time;
-	f_inode.vstat.st_mtime = current_time;
-
-	for(int i=0; i<16; i++)
-		f_inode.direct_ptr[i] = -1;
-	for(int i=0; i<8; i++)
-		f_inode.indirect_ptr[i] = -1;
-
-	// Step 6: Call writei() to write inode to disk
-	writei(ino, &f_inode);
 	
 	if(debugOuter)
 		printf("\n---> Exiting the rufs_mkdir with status SUCCESS\n");
@@ -1046,22 +3661,27 @@ static int rufs_rmdir(const char *path) {
 		printf("\nTarget File: %s", base_name);
 	}
 	
-	// Step 2: Call get_node_by_path() to get inode of target directory
-	struct inode final_inode;
+	// Step 2: Call get_ino_by_path() and iget() to get inode of target directory,
+	// it stays write locked so nothing is added to it until it is gone
+	uint32_t ino;
+	struct inode *final_inode;
 	// Step 2: If not find, return -1
-	if(get_node_by_path(path, 0, &final_inode) < 0){
+	if(get_ino_by_path(path, 0, &ino) < 0 || (final_inode = iget(ino)) == NULL){
 		if(debugInner)
 			printf("\n    -> Path not found");
 		free(base_name);
 		free(dir_name);
 		return -1;
 	}
+	iwlock(final_inode);
 
 	// Step 3: Clear data block bitmap of target directory and its data block
 	// There should be no data blocks as dir should be empty
-	if(final_inode.size > 0){
+	if(final_inode->size > 0){
 		if(debugInner)
             printf("\n    -> Directory is not empty");
+		iunlock(final_inode);
+		iput(final_inode);
 		free(base_name);
 		free(dir_name);
         return -ENOTEMPTY; // or another appropriate error code
@@ -1069,33 +3689,43 @@ static int rufs_rmdir(const char *path) {
 
 	// Clearing Data_blocks not required
 
-	// Step 4: Clear inode bitmap
-	unset_bitmap(inode_bitmap, final_inode.ino);
-
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	struct inode dir_inode;
+	// Step 4: Call get_ino_by_path() and iget() to get inode of parent directory
+	uint32_t dir_ino;
+	struct inode *dir_inode;
 	if(debugInner)
-		printf("     -> going to call get_node_by_path in rmdir\n");
-	if(get_node_by_path(dir_name, 0, &dir_inode)<0){
+		printf("     -> going to call get_ino_by_path in rmdir\n");
+	if(get_ino_by_path(dir_name, 0, &dir_ino)<0 || (dir_inode = iget(dir_ino)) == NULL){
 		if(debugOuter)
 			printf("\n---> Exiting the rufs_rmdir with status FAILURE\n");
+		iunlock(final_inode);
+		iput(final_inode);
 		free(base_name);
 		free(dir_name);
 		return -ENOENT;
 	}
 
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-	printf("Entering dir_remove now");
-	fflush(stdout);
-	if(dir_remove(dir_inode, base_name, strlen(base_name)) < 0)
+	// Step 5: Call dir_remove() to remove directory entry of target directory in its parent directory
+	int ret = dir_remove(dir_inode, base_name, strlen(base_name));
+	iput(dir_inode);
+	if(ret < 0)
 	{
 		if(debugOuter)
 			printf("\n---> Exiting the rufs_rmdir with status FAILURE\n");
+		iunlock(final_inode);
+		iput(final_inode);
 		free(base_name);
 		free(dir_name);
 		return -EIO;
 	}
 
+	// Step 6: Invalidate the inode, drop cached lookups inside it and clear inode bitmap
+	dcache_prune_dir(ino);
+	final_inode->valid = 0;
+	imark_dirty(final_inode);
+	iunlock(final_inode);
+	iput(final_inode);
+	release_ino(ino);
+
 	if(debugOuter)
 		printf("\n---> Exiting the rufs_rmdir with status SUCCESS\n");
 	free(base_name);
@@ -1110,11 +3740,171 @@ static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
     return 0;
 }
 
+/*
+ * Open files. rufs_open() and rufs_create() resolve the path once and
+ * keep the inode pinned in a struct rufs_file, whose address goes in
+ * fi->fh. read, write and release use it instead of looking the path up
+ * again. A call with fh 0, because no handle could be set up, resolves
+ * the path as before.
+ */
+struct rufs_file {
+	struct inode *inode;				/* pinned until rufs_release() */
+	unsigned free_gen;					/* free_gen of the inode at open */
+	pthread_mutex_t lock;				/* the fields below, reads may run in parallel */
+	unsigned map_gen;					/* map_gen of the inode the cursor was taken at */
+	int map_lblk, map_pblk, map_run;	/* last mapping looked up, map_run 0 if none */
+	int ra_next;						/* block a sequential read starts at */
+	int ra_win;							/* readahead window, 0 while reads are not sequential */
+	int ra_end;							/* blocks before this one have been read ahead */
+};
+
+// A handle for inode ino, NULL if the inode cannot be pinned
+static struct rufs_file *file_open(uint32_t ino) {
+	struct rufs_file *f = calloc(1, sizeof(struct rufs_file));
+	if(f == NULL)
+		return NULL;
+	f->inode = iget(ino);
+	if(f->inode == NULL){
+		free(f);
+		return NULL;
+	}
+	f->free_gen = __atomic_load_n(&((struct icache_entry *)f->inode)->free_gen, __ATOMIC_RELAXED);
+	pthread_mutex_init(&f->lock, NULL);
+	return f;
+}
+
+static void file_close(struct rufs_file *f) {
+	iput(f->inode);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
+
+static struct rufs_file *file_handle(struct fuse_file_info *fi) {
+	return (fi != NULL) ? (struct rufs_file *)(uintptr_t)fi->fh : NULL;
+}
+
+/*
+ * Pinned inode for an I/O call: the handle's, or looked up by path
+ * without one. Release it with file_iput(). Once the file is unlinked its
+ * number can be handed to a new file, so a handle to it gets NULL, like
+ * the path lookup would.
+ */
+static struct inode *file_iget(const char *path, struct fuse_file_info *fi) {
+	struct rufs_file *f = file_handle(fi);
+	uint32_t ino;
+
+	if(f != NULL){
+		unsigned gen = __atomic_load_n(&((struct icache_entry *)f->inode)->free_gen, __ATOMIC_RELAXED);
+		return (gen == f->free_gen) ? f->inode : NULL;
+	}
+	if(get_ino_by_path(path, 0, &ino) != 0)
+		return NULL;
+	return iget(ino);
+}
+
+static void file_iput(struct inode *inode, struct fuse_file_info *fi) {
+	if(file_handle(fi) == NULL)
+		iput(inode);
+}
+
+/*
+ * get_blkno_run() for reads through a handle. The handle keeps the last
+ * mapping it looked up, at least MAP_CURSOR_RUN blocks when they are
+ * contiguous, and answers from it until imark_dirty() changes the
+ * inode's map_gen. Sequential reads then map each extent or run once
+ * rather than once per call.
+ */
+#define MAP_CURSOR_RUN 64
+
+static int file_blkno_run(struct rufs_file *f, struct inode *inode, int lblk, int max, int *run) {
+	unsigned gen = __atomic_load_n(&((struct icache_entry *)inode)->map_gen, __ATOMIC_RELAXED);
+	int blk_num = -1;
+
+	if(f == NULL)
+		return get_blkno_run(inode, lblk, max, run);
+
+	pthread_mutex_lock(&f->lock);
+	if(f->map_run > 0 && f->map_gen == gen && lblk >= f->map_lblk && lblk < f->map_lblk + f->map_run){
+		blk_num = f->map_pblk + (lblk - f->map_lblk);
+		*run = f->map_run - (lblk - f->map_lblk);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	if(blk_num == -1){
+		blk_num = get_blkno_run(inode, lblk, (max > MAP_CURSOR_RUN) ? max : MAP_CURSOR_RUN, run);
+		if(blk_num != -1){
+			pthread_mutex_lock(&f->lock);
+			f->map_gen = gen;
+			f->map_lblk = lblk;
+			f->map_pblk = blk_num;
+			f->map_run = *run;
+			pthread_mutex_unlock(&f->lock);
+		}
+	}
+	if(*run > max)
+		*run = max;
+	return blk_num;
+}
+
+/*
+ * Readahead. Each handle remembers the block where its last read ended.
+ * A read that starts there is sequential: the first one opens a window of
+ * twice its size, at least RA_MIN blocks, and each time the reader comes
+ * within half a window of what has been read ahead, the next window is
+ * handed to bio_readahead() and the window doubles, up to
+ * -o readahead=N blocks. Mapping the window also brings the indirect or
+ * extent leaf blocks it needs into the block cache before the reader gets
+ * there. A read anywhere else closes the window.
+ */
+#define RA_MIN 4
+
+static void file_readahead(struct rufs_file *f, int lblk, int nblocks, int next) {
+	struct inode *inode;
+	int start = 0, len = 0;
+
+	if(rufs_opts.readahead <= 0 || f == NULL)
+		return;
+	inode = f->inode;
+
+	pthread_mutex_lock(&f->lock);
+	if(lblk == f->ra_next){
+		if(f->ra_win == 0){
+			f->ra_win = (2*nblocks > RA_MIN) ? 2*nblocks : RA_MIN;
+			if(f->ra_win > rufs_opts.readahead)
+				f->ra_win = rufs_opts.readahead;
+			f->ra_end = lblk + nblocks;
+		}
+		if(lblk + nblocks + f->ra_win/2 >= f->ra_end){
+			start = (f->ra_end > lblk + nblocks) ? f->ra_end : lblk + nblocks;
+			len = f->ra_win;
+			f->ra_end = start + len;
+			f->ra_win = (2*f->ra_win < rufs_opts.readahead) ? 2*f->ra_win : rufs_opts.readahead;
+		}
+	}
+	else
+		f->ra_win = 0;
+	f->ra_next = next;
+	pthread_mutex_unlock(&f->lock);
+
+	// Nothing past the end of the file, holes are skipped
+	int file_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(start + len > file_blocks)
+		len = file_blocks - start;
+	while(len > 0){
+		int run;
+		int blk_num = get_blkno_run(inode, start, len, &run);
+		if(blk_num != -1)
+			bio_readahead(blk_num, run);
+		start += run;
+		len -= run;
+	}
+}
+
 static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
 	if(debugOuter)
-		printf("\n---> ENTERING rufs_mkdir");
+		printf("\n---> ENTERING rufs_create");
 	char *dir_name = (char *)malloc(strlen(path) + 1);
 	char *base_name = (char *)malloc(strlen(path) + 1);
 	if(debugInner){
@@ -1127,86 +3917,91 @@ static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 		printf("\nTarget File: %s", base_name);
 	}
 	
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode dir_inode;
+	// Step 2: Call get_ino_by_path() and iget() to get inode of parent directory
+	uint32_t dir_ino;
+	struct inode *dir_inode;
 	if(debugInner)
-		printf("     -> going to call get_node_by_path in mkdir\n");
-	if(get_node_by_path(dir_name, 0, &dir_inode)<0){
+		printf("     -> going to call get_ino_by_path in create\n");
+	if(get_ino_by_path(dir_name, 0, &dir_ino)<0 || (dir_inode = iget(dir_ino)) == NULL){
 		if(debugOuter)
-			printf("\n---> Exiting the rufs_opendir with status FAILURE\n");
+			printf("\n---> Exiting the rufs_create with status FAILURE\n");
 		free(base_name);
 		free(dir_name);
 		return -ENOENT;
 	}
 	if(debugInner)
-		printf("\n     -> Dir Inode's Ino # is %d", dir_inode.ino);
+		printf("\n     -> Dir Inode's Ino # is %d", dir_inode->ino);
 
 	struct dirent entry;
-	if(dir_inode.direct_ptr[0] != -1 && dir_find(dir_inode.ino, base_name, strlen(base_name), &entry) == 0){
+	if(dir_find(dir_inode->ino, base_name, strlen(base_name), &entry) == 0){
 		if(debugInner)
 			printf("\n     -> Directory/File with name %s already exists", base_name);
 		if(debugOuter)
-				printf("\n---> EXITING dir_add with status FAILURE\n");
+				printf("\n---> EXITING rufs_create with status FAILURE\n");
+		iput(dir_inode);
+		free(base_name);
+		free(dir_name);
 		return -EEXIST;
 	}
 
 	if(debugInner)
-		printf("     -> going to call get_avail_ino in mkdir\n");
+		printf("     -> going to call get_avail_ino in create\n");
 	
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int ino = get_avail_ino();
+	// Step 3: Call get_avail_ino_near() to get an available inode number
+	int ino = get_avail_ino_near(ialloc_goal(dir_inode, 0));
 	if(ino == -1){
-		return -ENOMEM;
-	}
-	if(debugInner)
-		printf("\n     ->New inode #: %d", ino);
-
-	if(debugInner)
-		printf(" \n     -> going to call dir_add in mkdir\n");
-	
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	if(dir_add(dir_inode, ino, base_name, strlen(base_name)) < 0)
-	{
-		if(debugOuter)
-			printf("\n---> Exiting the rufs_opendir with status FAILURE\n");
+		iput(dir_inode);
 		free(base_name);
 		free(dir_name);
-		return -EIO;
+		return -ENOSPC;
 	}
+	if(debugInner)
+		printf("\n     ->New inode #: %d", ino);
 
-	// Step 5: Update inode for target file
+	// Step 4: Update inode for target file. It is written before the name
+	// is added, so a lookup that finds the name never reads a stale inode
 	struct inode f_inode;
 	f_inode.ino = ino;
 	f_inode.size = 0;		// TODO: Update size when writing to file's data block
 	f_inode.valid = 1;
+	f_inode.flags = 0;
 	f_inode.type = __S_IFREG | (mode & 0777);
 	f_inode.link = 1;
-	f_inode.vstat.st_dev = 0;
-	f_inode.vstat.st_ino = f_inode.ino;
-	f_inode.vstat.st_mode = f_inode.type;  // Directory with permissions as provided
-	f_inode.vstat.st_nlink = f_inode.link;
-	f_inode.vstat.st_uid = getuid();
-	f_inode.vstat.st_gid = getgid();
-	f_inode.vstat.st_rdev = 0;
-	f_inode.vstat.st_size = f_inode.size;
-	f_inode.vstat.st_blksize = BLOCK_SIZE;
-	f_inode.vstat.st_blocks = 0;
+	f_inode.uid = getuid();
+	f_inode.gid = getgid();
 	
-	time_t current_time = time(NULL);
-	f_inode.vstat.st_atime = current_time;
-	f_inode.vstat.st_mtime = current_time;
+	clock_gettime(CLOCK_REALTIME, &f_inode.atime);
+	f_inode.mtime = f_inode.atime;
+	f_inode.ctime = f_inode.atime;
 
-	for(int i=0; i<16; i++)
-		f_inode.direct_ptr[i] = -1;
-	for(int i=0; i<8; i++)
-		f_inode.indirect_ptr[i] = -1;
+	init_blkmap(&f_inode);
 
-	// Step 6: Call writei() to write inode to disk
+	// Step 5: Call writei() to write inode to disk
 	writei(ino, &f_inode);
+
+	if(debugInner)
+		printf(" \n     -> going to call dir_add in create\n");
+	
+	// Step 6: Call dir_add() to add directory entry of target file to parent directory
+	int ret = dir_add(dir_inode, ino, base_name, strlen(base_name));
+	iput(dir_inode);
+	if(ret < 0)
+	{
+		if(debugOuter)
+			printf("\n---> Exiting the rufs_create with status FAILURE\n");
+		f_inode.valid = 0;
+		writei(ino, &f_inode);
+		release_ino(ino);
+		free(base_name);
+		free(dir_name);
+		return ret;
+	}
+
+	// Step 7: The file is open now, hand out its handle
+	fi->fh = (uintptr_t)file_open(ino);
 	
 	if(debugOuter)
-		printf("\n---> Exiting the rufs_opendir with status SUCCESS\n");
-	debugInner = 0;
+		printf("\n---> Exiting the rufs_create with status SUCCESS\n");
 	free(base_name);
 	free(dir_name);
     return 0;
@@ -1216,14 +4011,16 @@ static int rufs_open(const char *path, struct fuse_file_info *fi) {
 
 	if(debugOuter)
 		printf("\n---> ENTERING rufs_open");
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode my_inode;
-	// Step 2: If not find, return -1
-	if(get_node_by_path(path, 0, &my_inode) < 0){
+	// Step 1: Call get_ino_by_path() to get the inode number from path
+	uint32_t ino;
+	// Step 2: If not find, return -ENOENT
+	if(get_ino_by_path(path, 0, &ino) < 0){
 		if(debugInner)
 			printf("\n    -> Path not found");
-		return -1;
+		return -ENOENT;
 	}
+	// Step 3: Pin the inode in a handle for the calls that follow
+	fi->fh = (uintptr_t)file_open(ino);
 	if(debugOuter)
 		printf("\n---> EXITING rufs_open\n");
 	return 0;
@@ -1233,70 +4030,73 @@ static int rufs_read(const char *path, char *buffer, size_t size, off_t offset,
     if (debugOuter)
         printf("\n---> ENTERING rufs_read");
 
-    struct inode my_inode;
-    if (get_node_by_path(path, 0, &my_inode) != 0) {
+    // Step 1: Take the inode from the open file handle, or from path without one
+    struct rufs_file *f = file_handle(fi);
+    struct inode *my_inode = file_iget(path, fi);
+    if (my_inode == NULL) {
         perror("Error getting inode for the target inode");
         return -ENOENT; // Return appropriate error code for "No such file or directory"
     }
+    irlock(my_inode);
 
-    int temp_size = 0;
-    int blk_read_loc = (offset % BLOCK_SIZE);
-    int start_blk = offset / BLOCK_SIZE;
-
+    // Step 2: Based on size and offset, read its data blocks from disk
+    if (offset >= my_inode->size) {
+        iunlock(my_inode);
+        file_iput(my_inode, fi);
+        return 0;
+    }
+    if (offset + size > my_inode->size)
+        size = my_inode->size - offset;
+
+    // Small files are read straight out of the inode, others start reading
+    // ahead once reads turn out to be sequential
+    size_t temp_size = 0;
+    if (my_inode->flags & INODE_FL_INLINE) {
+        memcpy(buffer, (char *)my_inode->i_block + offset, size);
+        temp_size = size;
+    } else {
+        int first = offset / BLOCK_SIZE;
+        file_readahead(f, first, (offset + size - 1) / BLOCK_SIZE + 1 - first, (offset + size) / BLOCK_SIZE);
+    }
     while (temp_size < size) {
-        // Handling direct pointers
-        if (start_blk < 16) {
-            memset(data_blk, 0, BLOCK_SIZE);
-            bio_read(my_inode.direct_ptr[start_blk], data_blk);
-
-            // Read from block
-            int limit = (size - temp_size) < (BLOCK_SIZE - blk_read_loc) ? (size - temp_size) : (BLOCK_SIZE - blk_read_loc);
-            memcpy(buffer + temp_size, data_blk + blk_read_loc, limit);
-
-            temp_size += limit;
-            start_blk++;
-            blk_read_loc = 0;
-        } else {
-            // Handling indirect pointers
-            // Removing direct data blocks
-            start_blk -= 16;
-            start_blk /= (BLOCK_SIZE / sizeof(int));
-            int start_blk_db_offset = start_blk % (BLOCK_SIZE / sizeof(int));
-
-            // Knowing the data block index and reading it
-            int final_blk_num = my_inode.indirect_ptr[start_blk];
-            // If the indirect pointer is not allocated, allocate it
-            if (final_blk_num == -1) {
-                return -1;
+        int lblk = (offset + temp_size) / BLOCK_SIZE;
+        int blk_read_loc = (offset + temp_size) % BLOCK_SIZE;
+        int limit = (size - temp_size) < (BLOCK_SIZE - blk_read_loc) ? (size - temp_size) : (BLOCK_SIZE - blk_read_loc);
+
+        // Whole blocks that are contiguous on disk are read in one go
+        int nblocks = (blk_read_loc == 0) ? (size - temp_size) / BLOCK_SIZE : 0;
+        int run;
+        int blk_num = file_blkno_run(f, my_inode, lblk, nblocks > 0 ? nblocks : 1, &run);
+        if (blk_num != -1 && nblocks > 0) {
+            if (bio_readv(blk_num, run, buffer + temp_size) < 0) {
+                iunlock(my_inode);
+                file_iput(my_inode, fi);
+                return -EIO;
             }
+            temp_size += (size_t)run * BLOCK_SIZE;
+            continue;
+        }
 
-            memset(data_blk, 0, BLOCK_SIZE);
-            bio_read(final_blk_num, data_blk);
-            int *entries = (int *)data_blk;
-            int db_to_read = entries[start_blk_db_offset];
-
-            if (db_to_read == -1) {
-                return -1;
+        // Step 3: copy the correct amount of data from offset to buffer, holes read as zeroes
+        if (blk_num == -1) {
+            memset(buffer + temp_size, 0, limit);
+        } else {
+            char *data = bio_get(blk_num);
+            if (data == NULL) {
+                iunlock(my_inode);
+                file_iput(my_inode, fi);
+                return -EIO;
             }
-
-            memset(data_blk, 0, BLOCK_SIZE);
-            bio_read(db_to_read, data_blk);
-
-            // Read from block
-            int limit = (size - temp_size) < (BLOCK_SIZE - final_blk_num) ? (size - temp_size) : (BLOCK_SIZE - final_blk_num);
-            memcpy(buffer + temp_size, data_blk + final_blk_num, limit);
-
-            temp_size += limit;
-            start_blk++;
-            final_blk_num = 0;
+            memcpy(buffer + temp_size, data + blk_read_loc, limit);
+            bio_put(blk_num, data, 0);
         }
+        temp_size += limit;
     }
 
-    // Step 4: Update the inode info and write it to disk
-    time_t current_time = time(NULL);
-    my_inode.vstat.st_atime = current_time;
-    my_inode.vstat.st_mtime = current_time;
-    writei(my_inode.ino, &my_inode);
+    // Step 4: Update the access time
+    iaccessed(my_inode);
+    iunlock(my_inode);
+    file_iput(my_inode, fi);
 
     if (debugOuter)
         printf("\n---> EXITING rufs_read\n");
@@ -1309,102 +4109,105 @@ static int rufs_write(const char *path, const char *buffer, size_t size, off_t o
     if (debugOuter)
         printf("\n---> ENTERING rufs_write");
 
-    struct inode my_inode;
-    if (get_node_by_path(path, 0, &my_inode) != 0) {
+    // Step 1: Take the inode from the open file handle, or from path without one
+    struct inode *my_inode = file_iget(path, fi);
+    if (my_inode == NULL) {
         perror("Error getting inode for the target inode");
         return -ENOENT; // Return appropriate error code for "No such file or directory"
     }
+    iwlock(my_inode);
 
-    int temp_size = 0;
-    int blk_write_loc = offset % BLOCK_SIZE;
-    int start_blk = offset / BLOCK_SIZE;
-
-    while (temp_size < size) {
-        // Handling direct pointers
-        if (start_blk < 16) {
-            memset(data_blk, 0, BLOCK_SIZE);
-            // Get the block locally
-            if (my_inode.direct_ptr[start_blk] == -1) {
-                my_inode.direct_ptr[start_blk] = get_avail_blkno();
-				if(my_inode.direct_ptr[start_blk] == -1){
-					return -ENOMEM;
-				}
-                writei(my_inode.ino, &my_inode);
-            }
-            bio_read(my_inode.direct_ptr[start_blk], data_blk);
-
-            // Write in block
-            int limit = (size - temp_size) < (BLOCK_SIZE - blk_write_loc) ? (size - temp_size) : (BLOCK_SIZE - blk_write_loc);
-            memcpy(data_blk + blk_write_loc, buffer + temp_size, limit);
-
-            // Write data block back to disk
-            bio_write(my_inode.direct_ptr[start_blk], data_blk);
+    // The file may have been unlinked while we waited for the lock
+    if (!my_inode->valid) {
+        iunlock(my_inode);
+        file_iput(my_inode, fi);
+        return -ENOENT;
+    }
 
-            temp_size += limit;
-            start_blk++;
-            blk_write_loc = 0;
-        } else {
-            // Handling indirect pointers
-            // Removing direct data blocks
-            start_blk -= 16;
-            start_blk /= (BLOCK_SIZE / sizeof(int));
-            int start_blk_db_offset = start_blk % (BLOCK_SIZE / sizeof(int));
-
-            // Knowing the data block index and reading it
-            int final_blk_num = my_inode.indirect_ptr[start_blk];
-            // If the indirect pointer is not allocated, allocate it
-            if (final_blk_num == -1) {
-                final_blk_num = get_avail_blkno();
-				if(final_blk_num == -1){
-					return -ENOMEM;
-				}
-                my_inode.indirect_ptr[start_blk] = final_blk_num;
-                writei(my_inode.ino, &my_inode);
-            }
+    // Small files stay in the inode until a write goes past INLINE_MAX
+    size_t temp_size = 0;
+    int in_inode = 0;
+    if (my_inode->flags & INODE_FL_INLINE) {
+        if (offset + size <= INLINE_MAX) {
+            memcpy((char *)my_inode->i_block + offset, buffer, size);
+            temp_size = size;
+            in_inode = 1;
+        } else if (inline_expand(my_inode, NULL) < 0) {
+            iunlock(my_inode);
+            file_iput(my_inode, fi);
+            return -ENOSPC;
+        }
+    }
 
-            memset(data_blk, 0, BLOCK_SIZE);
-            bio_read(final_blk_num, data_blk);
-            int *entries = (int *)data_blk;
-            int db_to_read = entries[start_blk_db_offset];
-
-            if (db_to_read == -1) {
-                db_to_read = get_avail_blkno();
-				if(db_to_read == -1){
-					return -ENOMEM;
-				}
-                entries[start_blk_db_offset] = db_to_read;
-                bio_write(final_blk_num, data_blk);
-            }
+    // Step 2: Based on size and offset, read its data blocks from disk
+    while (temp_size < size) {
+        int blk_write_loc = (offset + temp_size) % BLOCK_SIZE;
+        int limit = (size - temp_size) < (BLOCK_SIZE - blk_write_loc) ? (size - temp_size) : (BLOCK_SIZE - blk_write_loc);
+
+        // Get the block, allocating data and indirect blocks as needed
+        int lblk = (offset + temp_size) / BLOCK_SIZE;
+        int blk_num = get_blkno(my_inode, lblk, 0);
+        int fresh = (blk_num == -1);
+        if (fresh)
+            blk_num = get_blkno(my_inode, lblk, 1);
+        if (blk_num == -1)
+            break;
+
+        // Whole blocks go straight from the FUSE buffer without reading them
+        // first: runs that are contiguous on disk in one write, a single
+        // block through the cache
+        int nblocks = (blk_write_loc == 0) ? (size - temp_size) / BLOCK_SIZE : 0;
+        if (nblocks > 0) {
+            int run = 1;
+            while (run < nblocks && get_blkno(my_inode, lblk + run, 1) == blk_num + run)
+                run++;
+            int ret = (run > 1) ? bio_writev(blk_num, run, buffer + temp_size) : bio_write_data(blk_num, buffer + temp_size);
+            if (ret < 0)
+                break;
+            temp_size += (size_t)run * BLOCK_SIZE;
+            continue;
+        }
 
+        // Step 3: Write the correct amount of data from offset to disk. A block
+        // allocated just now holds nothing of this file, so it is zeroed
+        // instead of read
+        if (fresh)
             memset(data_blk, 0, BLOCK_SIZE);
-            bio_read(db_to_read, data_blk);
-
-            // Write in block
-            int limit = (size - temp_size) < (BLOCK_SIZE - blk_write_loc) ? (size - temp_size) : (BLOCK_SIZE - blk_write_loc);
-            memcpy(data_blk + blk_write_loc, buffer + temp_size, limit);
+        else
+            bio_read(blk_num, data_blk);
+        memcpy(data_blk + blk_write_loc, buffer + temp_size, limit);
+        bio_write_data(blk_num, data_blk);
 
-            // Write data block back to disk
-            bio_write(db_to_read, data_blk);
-
-            temp_size += limit;
-            start_blk++;
-            blk_write_loc = 0;
-        }
+        temp_size += limit;
     }
 
     // Step 4: Update the inode info and write it to disk
-    time_t current_time = time(NULL);
-    my_inode.vstat.st_atime = current_time;
-    my_inode.vstat.st_mtime = current_time;
-    my_inode.size += ((offset + size) - my_inode.size);
-
-    writei(my_inode.ino, &my_inode);
+    struct timespec current_time;
+    clock_gettime(CLOCK_REALTIME, &current_time);
+    my_inode->atime = current_time;
+    my_inode->mtime = current_time;
+    my_inode->ctime = current_time;
+    if (offset + temp_size > my_inode->size) {
+        my_inode->size = offset + temp_size;
+        imark_dirty(my_inode);
+    } else if (in_inode) {
+        // Inline data is part of the inode, so fdatasync must write it too
+        imark_dirty(my_inode);
+    } else {
+        // Overwrite, block allocations already marked the inode dirty
+        imark_time(my_inode);
+    }
+    iunlock(my_inode);
+    file_iput(my_inode, fi);
 
     if (debugOuter)
         printf("\n---> EXITING rufs_write\n");
 
+    if (temp_size == 0 && size > 0)
+        return -ENOSPC;
+
     // Note: this function should return the amount of bytes you write to disk
-    return size;
+    return temp_size;
 }
 
 static int rufs_unlink(const char *path) {
@@ -1412,9 +4215,7 @@ static int rufs_unlink(const char *path) {
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
 	if(debugOuter)
 		printf("\n---> ENTERING rufs_unlink");
-	memset(data_blk2, 0, BLOCK_SIZE);
 	char *dir_name = (char *)malloc(strlen(path) + 1);
-	memset(data_blk3, 0, BLOCK_SIZE);
 	char *base_name = (char *)malloc(strlen(path) + 1);
 	if(debugInner){
 		printf("Original Path given: %s", path);
@@ -1426,49 +4227,23 @@ static int rufs_unlink(const char *path) {
 		printf("\nTarget File: %s", base_name);
 	}
 	
-	// Step 2: Call get_node_by_path() to get inode of target file
-	struct inode final_inode;
+	// Step 2: Call get_ino_by_path() to get inode of target file
+	uint32_t ino;
 	// Step 2: If not find, return -1
-	if(get_node_by_path(path, 0, &final_inode) < 0){
+	if(get_ino_by_path(path, 0, &ino) < 0){
 		if(debugInner)
 			printf("\n    -> Path not found");
 		free(base_name);
 		free(dir_name);
-		return -1;
-	}
-
-	// Step 3: Clear data block bitmap of target file
-	for(int i=0; i<16; i++){
-		if(final_inode.direct_ptr[i] == -1)
-			break;
-		unset_bitmap(data_bitmap, final_inode.direct_ptr[i] - my_super_block->d_start_blk);
-		final_inode.direct_ptr[i] = -1;
-	}
-	
-	for(int i=0; i<8; i++){
-		if(final_inode.indirect_ptr[i] == -1)
-			break;
-		memset(data_blk, 0, BLOCK_SIZE);
-		bio_read(final_inode.indirect_ptr[i], data_blk);
-		int *blk_nums = (int*)data_blk;
-		int k = 0;
-		while(blk_nums[k] != -1 && k < (BLOCK_SIZE/sizeof(int))){
-			unset_bitmap(data_bitmap, blk_nums[k] - my_super_block->d_start_blk);
-			blk_nums[k] = -1;
-			k++;
-		}
-		unset_bitmap(data_bitmap, final_inode.indirect_ptr[i] - my_super_block->d_start_blk);
-		final_inode.indirect_ptr[i] = -1;
+		return -ENOENT;
 	}
 
-	// Step 4: Clear inode bitmap and its data block
-	unset_bitmap(inode_bitmap, final_inode.ino);
-
-	// Step 5: Call get_node_by_path() to get inode of parent directory
-	struct inode dir_inode;
+	// Step 3: Call get_ino_by_path() and iget() to get inode of parent directory
+	uint32_t dir_ino;
+	struct inode *dir_inode;
 	if(debugInner)
-		printf("     -> going to call get_node_by_path in unlink\n");
-	if(get_node_by_path(dir_name, 0, &dir_inode)<0){
+		printf("     -> going to call get_ino_by_path in unlink\n");
+	if(get_ino_by_path(dir_name, 0, &dir_ino)<0 || (dir_inode = iget(dir_ino)) == NULL){
 		if(debugOuter)
 			printf("\n---> Exiting the rufs_unlink with status FAILURE\n");
 		free(base_name);
@@ -1476,8 +4251,10 @@ static int rufs_unlink(const char *path) {
 		return -ENOENT;
 	}
 
-	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-	if(dir_remove(dir_inode, base_name, strlen(base_name)) < 0)
+	// Step 4: Call dir_remove() to remove directory entry of target file in its parent directory
+	int ret = dir_remove(dir_inode, base_name, strlen(base_name));
+	iput(dir_inode);
+	if(ret < 0)
 	{
 		if(debugOuter)
 			printf("\n---> Exiting the rufs_unlink with status FAILURE\n");
@@ -1486,6 +4263,21 @@ static int rufs_unlink(const char *path) {
 		return -EIO;
 	}
 
+	// Step 5: Clear data block bitmap of target file
+	struct inode *final_inode = iget(ino);
+	if(final_inode != NULL){
+		iwlock(final_inode);
+		free_blkmap(final_inode);
+
+		// Step 6: Invalidate the inode and clear inode bitmap
+		final_inode->valid = 0;
+		final_inode->size = 0;
+		imark_dirty(final_inode);
+		iunlock(final_inode);
+		iput(final_inode);
+	}
+	release_ino(ino);
+
 	if(debugOuter)
 		printf("\n---> Exiting the rufs_unlink with status SUCCESS\n");
 	free(base_name);
@@ -1493,15 +4285,80 @@ static int rufs_unlink(const char *path) {
 	return 0;
 }
 
+static int rufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	// Step 1: Take the inode from the open file handle, or from path without one
+	struct inode *inode = file_iget(path, fi);
+	if(inode == NULL)
+		return -ENOENT;
+	iwlock(inode);
+	int ret = 0;
+	int extents = (inode->flags & INODE_FL_EXTENTS) ||
+				  ((inode->flags & INODE_FL_INLINE) && (my_super_block->features & SB_FEAT_EXTENTS));
+	off_t max_size = extents ? (off_t)UINT32_MAX : (off_t)(16 + 8*PTRS_PER_BLK) * BLOCK_SIZE;
+	if(!inode->valid)
+		ret = -ENOENT;
+	else if(S_ISDIR(inode->type))
+		ret = -EISDIR;
+	else if(size < 0 || size > max_size)
+		ret = (size < 0) ? -EINVAL : -EFBIG;
+	if(ret < 0){
+		iunlock(inode);
+		file_iput(inode, fi);
+		return ret;
+	}
+
+	// Step 2: Inline contents past the new size are zeroed, so growing the
+	// file again reads zeroes; growing past INLINE_MAX gives it a block map
+	if(inode->flags & INODE_FL_INLINE){
+		if(size < inode->size)
+			memset((char *)inode->i_block + size, 0, inode->size - size);
+		else if(size > INLINE_MAX && inline_expand(inode, NULL) < 0)
+			ret = -ENOSPC;
+	}
+
+	// Step 3: Shrinking frees every block past the new end and zeroes the
+	// rest of the last one. Growing allocates nothing, the new part is a hole.
+	if(ret == 0 && !(inode->flags & INODE_FL_INLINE) && size < inode->size){
+		blkmap_truncate(inode, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		int blk_num = (size % BLOCK_SIZE) ? get_blkno(inode, size / BLOCK_SIZE, 0) : -1;
+		if(blk_num != -1){
+			bio_read(blk_num, data_blk);
+			memset((char *)data_blk + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+			bio_write_data(blk_num, data_blk);
+		}
+	}
+
+	// Step 4: Update the inode
+	if(ret == 0){
+		inode->size = size;
+		clock_gettime(CLOCK_REALTIME, &inode->mtime);
+		inode->ctime = inode->mtime;
+		imark_dirty(inode);
+	}
+	iunlock(inode);
+	file_iput(inode, fi);
+	return ret;
+}
+
 static int rufs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	return rufs_ftruncate(path, size, NULL);
 }
 
 static int rufs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+	// Give back the blocks preallocated for the file that were not written,
+	// then drop the handle
+	struct rufs_file *f = file_handle(fi);
+	struct inode *inode = file_iget(path, fi);
+	if(inode != NULL){
+		iwlock(inode);
+		idiscard_prealloc(inode);
+		iunlock(inode);
+		file_iput(inode, fi);
+	}
+	if(f != NULL){
+		file_close(f);
+		fi->fh = 0;
+	}
 	return 0;
 }
 
@@ -1511,6 +4368,77 @@ static int rufs_flush(const char * path, struct fuse_file_info * fi) {
     return 0;
 }
 
+/*
+ * Most runs of blocks rufs_fsync() writes back one by one, a file in more
+ * pieces is synced along with the whole cache
+ */
+#define FSYNC_MAX_RUNS 1024
+
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	static __thread struct bio_run runs[FSYNC_MAX_RUNS];
+	int n = 0;
+
+	// Step 1: Find the file, through its handle when it is open. Writing
+	// its metadata to the cache dirties held blocks, so that part runs as a
+	// transaction like any other operation
+	journal_start();
+	struct inode *inode = file_iget(path, fi);
+	if(inode == NULL){
+		journal_stop();
+		return -ENOENT;
+	}
+
+	// Step 2: Its inode goes to the block cache, timestamps only changed
+	// included unless just the data is synced
+	irlock(inode);
+	int i_blk_num = iflush_inode(inode, !datasync);
+
+	// Step 3: Collect its inode block, data blocks and mapping blocks
+	int whole = (i_blk_num < 0 || add_run(runs, &n, FSYNC_MAX_RUNS, i_blk_num, 1) < 0 ||
+				 blkmap_runs(inode, runs, &n, FSYNC_MAX_RUNS) < 0);
+	iunlock(inode);
+	file_iput(inode, fi);
+
+	// Step 4: And the bitmap blocks that changed
+	if(bitmaps_store(runs, &n, FSYNC_MAX_RUNS) < 0)
+		whole = 1;
+	journal_stop();
+
+	// Step 5: Without a journal only the blocks collected are written back
+	// before the barrier. With one, they are written back first and the
+	// commit adds the data of new blocks, the metadata and one barrier for
+	// all of it. Other files' data already on disk stays in the cache.
+	int ret;
+	if(!journaling)
+		ret = whole ? bio_sync() : bio_sync_runs(runs, n);
+	else{
+		ret = whole ? bio_flush() : bio_flush_runs(runs, n);
+		int committed = journal_commit();
+		if(committed < 0 || (committed == 0 && bio_barrier() < 0))
+			ret = -1;
+	}
+	return (ret < 0) ? -EIO : 0;
+}
+
+static int rufs_statfs(const char *path, struct statvfs *stbuf) {
+	// The allocator keeps the free counts, nothing is scanned
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = my_super_block->blocks_count - dmap_base;
+	stbuf->f_files = my_super_block->inodes_count;
+	stbuf->f_namemax = DIRENT_NAME_MAX;
+
+	// Blocks freed by the running transaction are free as soon as it commits
+	pthread_mutex_lock(&alloc_lock);
+	stbuf->f_bfree = num_free_blocks + pending_blocks;
+	stbuf->f_ffree = num_free_inodes;
+	pthread_mutex_unlock(&alloc_lock);
+	stbuf->f_bavail = stbuf->f_bfree;
+	stbuf->f_favail = stbuf->f_ffree;
+	return 0;
+}
+
 static int rufs_utimens(const char *path, const struct timespec tv[2]) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
@@ -1518,37 +4446,109 @@ static int rufs_utimens(const char *path, const struct timespec tv[2]) {
 }
 
 
+/*
+ * Transactions. Every FUSE operation that looks at the file system runs
+ * between journal_start() and journal_stop(), so a journal commit, which
+ * waits for the running ones, never sees an operation half done. fsync
+ * commits itself, so it ends its transaction before the commit.
+ */
+#define JOURNALED(call) ({ journal_start(); int ret_ = (call); journal_stop(); ret_; })
+
+static int rufs_tx_getattr(const char *path, struct stat *stbuf) {
+	return JOURNALED(rufs_getattr(path, stbuf));
+}
+
+static int rufs_tx_opendir(const char *path, struct fuse_file_info *fi) {
+	return JOURNALED(rufs_opendir(path, fi));
+}
+
+static int rufs_tx_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	return JOURNALED(rufs_readdir(path, buffer, filler, offset, fi));
+}
+
+static int rufs_tx_mkdir(const char *path, mode_t mode) {
+	return JOURNALED(rufs_mkdir(path, mode));
+}
+
+static int rufs_tx_rmdir(const char *path) {
+	return JOURNALED(rufs_rmdir(path));
+}
+
+static int rufs_tx_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	return JOURNALED(rufs_create(path, mode, fi));
+}
+
+static int rufs_tx_open(const char *path, struct fuse_file_info *fi) {
+	return JOURNALED(rufs_open(path, fi));
+}
+
+static int rufs_tx_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	return JOURNALED(rufs_read(path, buffer, size, offset, fi));
+}
+
+static int rufs_tx_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	return JOURNALED(rufs_write(path, buffer, size, offset, fi));
+}
+
+static int rufs_tx_unlink(const char *path) {
+	return JOURNALED(rufs_unlink(path));
+}
+
+static int rufs_tx_truncate(const char *path, off_t size) {
+	return JOURNALED(rufs_truncate(path, size));
+}
+
+static int rufs_tx_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	return JOURNALED(rufs_ftruncate(path, size, fi));
+}
+
+static int rufs_tx_utimens(const char *path, const struct timespec tv[2]) {
+	return JOURNALED(rufs_utimens(path, tv));
+}
+
+static int rufs_tx_release(const char *path, struct fuse_file_info *fi) {
+	return JOURNALED(rufs_release(path, fi));
+}
+
 static struct fuse_operations rufs_ope = {
 	.init		= rufs_init,
 	.destroy	= rufs_destroy,
 
-	.getattr	= rufs_getattr,
-	.readdir	= rufs_readdir,
-	.opendir	= rufs_opendir,
+	.getattr	= rufs_tx_getattr,
+	.readdir	= rufs_tx_readdir,
+	.opendir	= rufs_tx_opendir,
 	.releasedir	= rufs_releasedir,
-	.mkdir		= rufs_mkdir,
-	.rmdir		= rufs_rmdir,
+	.mkdir		= rufs_tx_mkdir,
+	.rmdir		= rufs_tx_rmdir,
 
-	.create		= rufs_create,
-	.open		= rufs_open,
-	.read 		= rufs_read,
-	.write		= rufs_write,
-	.unlink		= rufs_unlink,
+	.create		= rufs_tx_create,
+	.open		= rufs_tx_open,
+	.read 		= rufs_tx_read,
+	.write		= rufs_tx_write,
+	.unlink		= rufs_tx_unlink,
 
-	.truncate   = rufs_truncate,
+	.truncate   = rufs_tx_truncate,
+	.ftruncate  = rufs_tx_ftruncate,
 	.flush      = rufs_flush,
-	.utimens    = rufs_utimens,
-	.release	= rufs_release
+	.fsync      = rufs_fsync,
+	.statfs     = rufs_statfs,
+	.utimens    = rufs_tx_utimens,
+	.release	= rufs_tx_release
 };
 
 
 int main(int argc, char *argv[]) {
 	int fuse_stat;
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
 
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	if(fuse_opt_parse(&args, &rufs_opts, rufs_opt_spec, NULL) == -1)
+		return 1;
+
+	fuse_stat = fuse_main(args.argc, args.argv, &rufs_ope, NULL);
 
+	fuse_opt_free_args(&args);
 	return fuse_stat;
 }
\ No newline at end of file
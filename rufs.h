@@ -14,9 +14,10 @@
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+#define MAGIC_NUM 0x5C3A			/* original layout, no feature flags */
+#define MAGIC_NUM_FEAT 0x5C3B		/* superblock carries feature flags */
+#define MAX_INUM 1024				/* inodes of an image made without -o size/inodes */
+#define MAX_DNUM 16384				/* blocks of an image made without -o size */
 //#define MAX_DNUM 8124
 
 // Function Declarations
@@ -31,26 +32,183 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	features;			/* SB_FEAT_*, only with MAGIC_NUM_FEAT */
+	uint32_t	block_size;			/* bytes per block, with SB_FEAT_GEOMETRY */
+	uint32_t	inodes_count;		/* number of inodes, with SB_FEAT_GEOMETRY */
+	uint64_t	blocks_count;		/* number of blocks, with SB_FEAT_GEOMETRY */
+	uint32_t	blocks_per_group;	/* with SB_FEAT_GROUPS */
+	uint32_t	inodes_per_group;	/* with SB_FEAT_GROUPS */
+	uint32_t	journal_blk;		/* first block of the journal, with SB_FEAT_JOURNAL */
+	uint32_t	journal_blocks;		/* length of the journal, with SB_FEAT_JOURNAL */
+	uint32_t	free_blocks_count;	/* free data blocks, recounted at mount */
+	uint32_t	free_inodes_count;	/* free inodes, recounted at mount */
 };
 
+/* superblock feature flags, chosen at mkfs time */
+#define SB_FEAT_VAR_DIRENT	0x01	/* directories use struct vdirent records */
+#define SB_FEAT_EXTENTS		0x02	/* new inodes map blocks with extents */
+#define SB_FEAT_GEOMETRY	0x04	/* sizes come from the fields after features */
+#define SB_FEAT_GROUPS		0x08	/* block groups, the *_blk fields are offsets into each group */
+#define SB_FEAT_INLINE_DATA	0x10	/* new inodes keep small contents in i_block */
+#define SB_FEAT_COMPACT_INODE	0x20	/* inode tables hold struct dinode, not struct dinode_v1 */
+#define SB_FEAT_JOURNAL		0x40	/* metadata journal, see journal.c */
+#define SB_FEAT_LARGE_INODE	0x80	/* with SB_FEAT_COMPACT_INODE, inodes are struct dinode_large */
+#define SB_FEAT_ALL			0xff	/* every flag this code knows */
+
+/*
+ * Extent tree. The root lives in i_block of the inode; at depth 0 it holds
+ * extents directly, at depth 1 it holds ext_idx entries pointing to leaf
+ * blocks of extents. Entries in every node are sorted by logical block.
+ */
+#define EXT_MAGIC 0xF30A
+
+struct ext_header {
+	uint16_t magic;					/* EXT_MAGIC */
+	uint16_t count;					/* entries in use */
+	uint16_t max;					/* entries that fit in the node */
+	uint16_t depth;					/* 0 if the entries are extents */
+};
+
+struct extent {
+	uint32_t lblk;					/* first logical block */
+	uint32_t len;					/* number of blocks */
+	uint32_t pblk;					/* first disk block */
+};
+
+struct ext_idx {
+	uint32_t lblk;					/* first logical block covered by the leaf */
+	uint32_t pblk;					/* disk block of the leaf */
+};
+
+/*
+ * In-memory inode. On disk it is a struct dinode, or a struct dinode_v1 on
+ * images without SB_FEAT_COMPACT_INODE; see dinode_load()/dinode_store().
+ */
 struct inode {
-	uint16_t	ino;				/* inode number */
-	uint16_t	valid;				/* validity of the inode */
+	uint32_t	ino;				/* inode number */
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		flags;				/* INODE_FL_* */
+	uint32_t	link;				/* link count */
+	uint32_t	type;				/* type and permissions of the file, as st_mode */
+	uint32_t	size;				/* size of the file */
+	uint32_t	uid;				/* owner */
+	uint32_t	gid;				/* group */
+	struct timespec	atime;			/* last access */
+	struct timespec	mtime;			/* last modification */
+	struct timespec	ctime;			/* last change of the inode */
+	union {
+		struct {
+			int	direct_ptr[16];		/* direct pointer to data block */
+			int	indirect_ptr[8];	/* indirect pointer to data block */
+		};
+		struct ext_header i_ext;	/* extent tree root with INODE_FL_EXTENTS, entries follow it */
+		uint32_t i_block[24];		/* data with INODE_FL_INLINE */
+	};
+};
+
+/*
+ * On-disk inode, 128 bytes. Timestamps are whole seconds, struct
+ * dinode_large adds the nanoseconds. Version 2 had no ctime and kept the
+ * nanoseconds of mtime in its place.
+ */
+#define DINODE_VERSION 3
+
+struct dinode {
+	uint16_t	mode;				/* type and permissions */
+	uint16_t	links;				/* link count */
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		flags;				/* INODE_FL_* */
+	uint16_t	version;			/* DINODE_VERSION */
+	uint32_t	size;				/* size of the file */
+	uint32_t	uid;				/* owner */
+	uint32_t	gid;				/* group */
+	uint32_t	atime;				/* last access, seconds */
+	uint32_t	mtime;				/* last modification, seconds */
+	uint32_t	ctime;				/* last change of the inode, seconds */
+	uint32_t	i_block[24];		/* block map or inline data */
+};
+
+/* On-disk inode, 256 bytes (-o inode_size=256, SB_FEAT_LARGE_INODE) */
+struct dinode_large {
+	struct dinode	d;
+	uint32_t	atime_nsec;			/* nanoseconds of d.atime */
+	uint32_t	mtime_nsec;			/* of d.mtime */
+	uint32_t	ctime_nsec;			/* of d.ctime */
+	uint8_t		pad[116];
+};
+
+/* Original 256 byte on-disk inode, a struct stat carries the attributes */
+struct dinode_v1 {
+	uint16_t	ino;				/* inode number, low 16 bits */
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		flags;				/* INODE_FL_* */
 	uint32_t	size;				/* size of the file */
 	uint32_t	type;				/* type of the file */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	uint32_t	i_block[24];		/* block map or inline data */
 	struct stat	vstat;				/* inode stat */
 };
 
-struct dirent {
+/* inode flags */
+#define INODE_FL_INDEX	0x01		/* directory blocks are hash indexed */
+#define INODE_FL_EXTENTS 0x02		/* blocks are mapped by an extent tree */
+#define INODE_FL_INLINE	0x04		/* data is kept in i_block, no blocks */
+
+/* Fixed size directory entry, the on-disk record without SB_FEAT_VAR_DIRENT */
+struct fdirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
 	char name[208];					/* name of the directory entry */
 	uint16_t len;					/* length of name */
 };
 
+/* Directory entry as the directory code passes it around, for either format */
+struct dirent {
+	uint32_t ino;					/* inode number of the directory entry */
+	uint16_t valid;					/* validity of the directory entry */
+	uint16_t len;					/* length of name */
+	char name[208];					/* name of the directory entry */
+};
+
+/*
+ * Variable length directory entries (SB_FEAT_VAR_DIRENT). A directory
+ * block is a chain of records whose rec_len add up to the block size, a
+ * record with name_len 0 is free space. Records are 4 byte aligned.
+ */
+struct vdirent {
+	uint32_t ino;					/* inode number of the directory entry */
+	uint16_t rec_len;				/* length of this record */
+	uint8_t name_len;				/* length of name, 0 if unused */
+	uint8_t reserved;
+	char name[];					/* name, not NUL terminated */
+};
+
+#define VDIRENT_LEN(name_len) ((sizeof(struct vdirent) + (name_len) + 3) & ~3)
+
+/* longest name either format can store */
+#define DIRENT_NAME_MAX 207
+
+/*
+ * Directory index blocks. Block 0 of an indexed directory is the root
+ * index; every index block is a dx_header followed by dx_entry records
+ * sorted by hash, pointing to lower index blocks or to leaf blocks of
+ * dirents (slots of struct fdirent, or vdirent records).
+ */
+#define DX_MAGIC 0x44584931
+
+struct dx_header {
+	uint32_t magic;					/* DX_MAGIC */
+	uint16_t levels;				/* index levels below the root (root only) */
+	uint16_t count;					/* entries in use */
+	uint32_t nblocks;				/* blocks used by the directory (root only) */
+	uint32_t reserved;
+};
+
+struct dx_entry {
+	uint32_t hash;					/* lowest name hash in the child, bit 0 marks a collision continuation */
+	uint32_t lblk;					/* logical block of the child */
+};
+
 
 /*
  * bitmap operations
@@ -69,4 +227,59 @@ uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
+// Bits 64*w .. 64*w+63 of the bitmap, bit i of the map is bit i%64 of the word
+uint64_t get_bitmap_word(bitmap_t b, int w) {
+    uint64_t x;
+    __builtin_memcpy(&x, b + w * 8, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+// Clear bits [from, from+n), whole 64-bit words with one memset
+void clear_bitmap_range(bitmap_t b, int from, int n) {
+    int to = from + n;
+    while (from < to && (from & 63))
+        unset_bitmap(b, from++);
+    if (to - from >= 64) {
+        int words = (to - from) / 64;
+        __builtin_memset(b + from / 8, 0, words * 8);
+        from += words * 64;
+    }
+    while (from < to)
+        unset_bitmap(b, from++);
+}
+
+// Set bits [from, from+n), whole 64-bit words with one memset
+void set_bitmap_range(bitmap_t b, int from, int n) {
+    int to = from + n;
+    while (from < to && (from & 63))
+        set_bitmap(b, from++);
+    if (to - from >= 64) {
+        int words = (to - from) / 64;
+        __builtin_memset(b + from / 8, 0xff, words * 8);
+        from += words * 64;
+    }
+    while (from < to)
+        set_bitmap(b, from++);
+}
+
+/*
+ * First clear bit in [from, to), or -1. The map is scanned a 64-bit word
+ * at a time, so fully used stretches cost one compare per 64 bits.
+ */
+int find_zero_bit(bitmap_t b, int from, int to) {
+    for (int w = from / 64; w * 64 < to; w++) {
+        uint64_t free_bits = ~get_bitmap_word(b, w);
+        if (w == from / 64)
+            free_bits &= ~0ULL << (from & 63);
+        if (free_bits != 0) {
+            int i = w * 64 + __builtin_ctzll(free_bits);
+            return (i < to) ? i : -1;
+        }
+    }
+    return -1;
+}
+
 #endif